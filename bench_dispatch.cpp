@@ -0,0 +1,133 @@
+/**
+ * 逐token分派的基准测试：不经网络与解析，像curl的写回调那样经函数指针把每个token交给消息对象，只测从写回调到用户回调的分派
+ * 对照组复刻改动前的做法：写回调收到Message_func*，dynamic_cast成具体的消息类型后经虚函数记录token，再经std::function调用回调函数
+ * 编译：g++ -std=c++17 -O2 bench_dispatch.cpp llm.cpp llm_impl.cpp -lcurl，Windows上另加-lws2_32
+ * 2026.10.16
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <algorithm>
+
+#include "llm.h"
+
+using std::cout;
+using std::string;
+using std::function;
+using std::chrono::steady_clock;
+
+namespace Old {          // 改动前的消息类型：token经虚函数记录，回调函数一律存为std::function
+
+    class Message_func {
+    public:
+        virtual void operator()(string&& ans) = 0;
+        virtual ~Message_func() { }
+    protected:
+        void add_ans(const string& ans) { answer.append(ans); }
+    private:
+        string answer;
+    };
+
+    class Chat_message : public Message_func {
+    public:
+        explicit Chat_message(function<void(string&&)> func) : func{std::move(func)} { }
+        void operator()(string&& ans) override
+        {
+            add_ans(ans);
+            func(std::move(ans));
+        }
+    private:
+        function<void(string&&)> func;
+    };
+
+    class Reasonal_message : public Message_func {
+    public:
+        explicit Reasonal_message(function<void(string&&, bool)> func) : func{std::move(func)} { }
+        void reason(string&& r)
+        {
+            reasoning.append(r);
+            func(std::move(r), true);
+        }
+        void operator()(string&& ans) override
+        {
+            add_ans(ans);
+            func(std::move(ans), false);
+        }
+    private:
+        function<void(string&&, bool)> func;
+        string reasoning;
+    };
+
+    void chat_write(string&& token, bool, void* data) { dynamic_cast<Chat_message&>(*static_cast<Message_func*>(data))(std::move(token)); }
+    void reason_write(string&& token, bool reasoning, void* data)
+    {
+        Reasonal_message& mfunc {dynamic_cast<Reasonal_message&>(*static_cast<Message_func*>(data))};
+        if (reasoning)
+            mfunc.reason(std::move(token));
+        else
+            mfunc(std::move(token));
+    }
+
+}
+
+template<typename Message>
+void chat_write(string&& token, bool, void* data) { (*static_cast<Message*>(data))(std::move(token)); }           // 现在的写回调按消息类型实例化
+
+template<typename Message>
+void reason_write(string&& token, bool reasoning, void* data)
+{
+    Message& mfunc {*static_cast<Message*>(data)};
+    if (reasoning)
+        mfunc.reason(std::move(token));
+    else
+        mfunc(std::move(token));
+}
+
+using Write = void(*)(string&&, bool, void*);
+
+template<typename Make>
+double per_token(Make make, Write write, size_t tokens, int rounds)           // 每轮新建一个消息对象并交给它tokens个token，深度思考与答案各占一半，返回最快一轮每个token的耗时(ns)
+{
+    Write volatile call {write};             // 与curl一样经函数指针调用写回调，不让编译器内联
+    double best {};
+    for (int i {}; i<rounds; ++i) {
+        auto mfunc = make();
+        auto start = steady_clock::now();
+        for (size_t j {}; j<tokens; ++j)
+            call(string{"a"}, j<tokens/2, mfunc.get());
+        double ns {std::chrono::duration<double, std::nano>(steady_clock::now()-start).count()/tokens};
+        best = (i == 0) ? ns : std::min(best, ns);
+    }
+    return best;
+}
+
+template<typename Message, typename F>
+std::unique_ptr<Message> make_message(F func) { return std::unique_ptr<Message>{new Message{CP_UTF8,std::move(func)}}; }
+
+int main()
+{
+    size_t tokens {10000000};
+    int rounds {5};
+    size_t bytes {};
+    auto chat = [&bytes](string&& token) { bytes += token.length(); };
+    auto reason = [&bytes](string&& token, bool) { bytes += token.length(); };
+    using Chat_lambda = LLM_impl::Chat_message<decltype(chat)>;
+    using Chat_function = LLM_impl::Chat_message<function<void(string&&)>>;
+    using Chat_sink = LLM_impl::Chat_message<LLM::Chat_sink>;
+    using Reason_lambda = LLM_impl::Reasonal_message<decltype(reason)>;
+    using Reason_function = LLM_impl::Reasonal_message<function<void(string&&, bool)>>;
+    cout << tokens << "个token，" << rounds << "轮\n" << std::fixed << std::setprecision(1);
+    cout << "Chat\n";
+    cout << "  改动前(dynamic_cast+虚函数+std::function)：" << per_token([&] { return std::unique_ptr<Old::Chat_message>{new Old::Chat_message{chat}}; }, Old::chat_write, tokens, rounds) << " ns/token\n";
+    cout << "  具体类型的lambda：" << per_token([&] { return make_message<Chat_lambda>(chat); }, chat_write<Chat_lambda>, tokens, rounds) << " ns/token\n";
+    cout << "  std::function：" << per_token([&] { return make_message<Chat_function>(function<void(string&&)>{chat}); }, chat_write<Chat_function>, tokens, rounds) << " ns/token\n";
+    cout << "  Chat_sink：" << per_token([&] { return make_message<Chat_sink>(LLM::Chat_sink{chat}); }, chat_write<Chat_sink>, tokens, rounds) << " ns/token\n";
+    cout << "Reasoner\n";
+    cout << "  改动前(dynamic_cast+虚函数+std::function)：" << per_token([&] { return std::unique_ptr<Old::Reasonal_message>{new Old::Reasonal_message{reason}}; }, Old::reason_write, tokens, rounds) << " ns/token\n";
+    cout << "  具体类型的lambda：" << per_token([&] { return make_message<Reason_lambda>(reason); }, reason_write<Reason_lambda>, tokens, rounds) << " ns/token\n";
+    cout << "  std::function：" << per_token([&] { return make_message<Reason_function>(function<void(string&&, bool)>{reason}); }, reason_write<Reason_function>, tokens, rounds) << " ns/token\n";
+    return (bytes) ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+/**
+ * 流式解析的基准测试：经Curl::Mock在进程内回放DeepSeek R1与Qwen(QwQ)格式的SSE响应，比较Scanner各实现(逐字节、SSE4.2、AVX2)的解析吞吐量
+ * 也可以给出一个录制下来的响应文件(原样保存的SSE响应体)，回放它代替内置的两种响应
+ * 编译：g++ -std=c++17 -O2 bench_parse.cpp llm.cpp llm_impl.cpp -lcurl，Windows上另加-lws2_32
+ * 2026.10.16
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <utility>
+#include <algorithm>
+
+#include "llm.h"
+
+using std::cout;
+using std::string;
+using std::vector;
+using std::chrono::steady_clock;
+
+const vector<string> pieces {"嗯", "，", "用户", "问的是", "如何", "在", " C++", " 中", "解析", "流式", "响应", "。", "首先", "，", "我需要", "考虑", "\\n\\n", "“", "SSE", "”", "的", "格式", "：", "每个", "事件", "以", " `data:`", " 开头", "，", "后面", "是", " JSON", "，", "其中", "可能", "有", "转义", "的", "\\\"", "引号", "\\\"", "和", "换行", "\\n", "Let", " me", " think", " about", " the", " edge", " cases", "."};
+
+string deepseek(size_t tokens)           // DeepSeek R1的响应：先深度思考再回答，每个事件带id、created、model等字段
+{
+    string response;
+    for (size_t i {}; i<tokens; ++i) {
+        bool reasoning {i < tokens*3/4};
+        string piece {'"'+pieces[i%pieces.size()]+'"'};
+        response += R"(data: {"id":"5e0b9a3c-7f21-4d8e-9c55-1a2b3c4d5e6f","object":"chat.completion.chunk","created":1738000000,"model":"deepseek-reasoner","system_fingerprint":"fp_5417b77867_prod","choices":[{"index":0,"delta":{"content":)";
+        response += (reasoning) ? "null" : piece;
+        response += R"(,"reasoning_content":)";
+        response += (reasoning) ? piece : "null";
+        response += R"(},"logprobs":null,"finish_reason":null}]})" "\n\n";
+    }
+    response += R"(data: {"id":"5e0b9a3c-7f21-4d8e-9c55-1a2b3c4d5e6f","object":"chat.completion.chunk","created":1738000000,"model":"deepseek-reasoner","system_fingerprint":"fp_5417b77867_prod","choices":[{"index":0,"delta":{"content":""},"logprobs":null,"finish_reason":"stop"}],"usage":{"prompt_tokens":12,"completion_tokens":)"+std::to_string(tokens)+R"(,"total_tokens":)"+std::to_string(tokens+12)+R"(,"prompt_tokens_details":{"cached_tokens":0},"completion_tokens_details":{"reasoning_tokens":)"+std::to_string(tokens*3/4)+R"(},"prompt_cache_hit_tokens":0,"prompt_cache_miss_tokens":12}})" "\n\n";
+    return response+"data: [DONE]\n\n";
+}
+
+string qwen(size_t tokens)           // Qwen(QwQ)兼容模式的响应：choices在前，usage为null，id在最后
+{
+    string response;
+    for (size_t i {}; i<tokens; ++i) {
+        bool reasoning {i < tokens*3/4};
+        string piece {'"'+pieces[i%pieces.size()]+'"'};
+        response += R"(data: {"choices":[{"delta":{"content":)";
+        response += (reasoning) ? "null" : piece;
+        response += R"(,"role":"assistant","reasoning_content":)";
+        response += (reasoning) ? piece : "null";
+        response += R"(},"index":0,"logprobs":null,"finish_reason":null}],"object":"chat.completion.chunk","usage":null,"created":1740000000,"system_fingerprint":null,"model":"qwq-plus","id":"chatcmpl-3f5c1a2e-8b7d-9c4e-a1f2-0d9e8c7b6a5f"})" "\n\n";
+    }
+    response += R"(data: {"choices":[{"finish_reason":"stop","delta":{"content":""},"index":0,"logprobs":null}],"object":"chat.completion.chunk","usage":{"prompt_tokens":12,"completion_tokens":)"+std::to_string(tokens)+R"(,"total_tokens":)"+std::to_string(tokens+12)+R"(},"created":1740000000,"system_fingerprint":null,"model":"qwq-plus","id":"chatcmpl-3f5c1a2e-8b7d-9c4e-a1f2-0d9e8c7b6a5f"})" "\n\n";
+    return response+"data: [DONE]\n\n";
+}
+
+double throughput(const string& response, int rounds)            // 回放rounds次，返回最快一次的吞吐量(GB/s)
+{
+    size_t bytes {};
+    LLM::Reasoner llm {"http://localhost/v1/chat/completions","bench","key",[&](string&& token, bool) { bytes += token.length(); },CP_UTF8,CP_UTF8};
+    llm.set_transport(Curl::Mock::factory(Curl::Script::split(response, 16*1024)));          // 与curl每次写回调的最大数据量相同
+    double best {};
+    for (int i {}; i<rounds; ++i) {
+        auto start = steady_clock::now();
+        llm.get("bench");
+        double seconds {std::chrono::duration<double>(steady_clock::now()-start).count()};
+        best = std::max(best, response.length()/seconds/1e9);
+        llm.clear_history();
+    }
+    return best;
+}
+
+int main(int argc, char* argv[])
+{
+    vector<std::pair<string, string>> streams;
+    if (argc > 1) {
+        std::ifstream file {argv[1], std::ios::binary};
+        if (not file) {
+            std::cerr << "无法打开" << argv[1] << '\n';
+            return 1;
+        }
+        std::ostringstream content;
+        content << file.rdbuf();
+        streams.emplace_back(argv[1], content.str());
+    }
+    else {
+        streams.emplace_back("DeepSeek R1", deepseek(200000));
+        streams.emplace_back("Qwen QwQ", qwen(200000));
+    }
+    const std::pair<LLM::Scanner::Path, string> paths[] {{LLM::Scanner::Path::scalar,"逐字节"}, {LLM::Scanner::Path::sse42,"SSE4.2"}, {LLM::Scanner::Path::avx2,"AVX2"}};
+    int rounds {5};
+    cout << std::fixed << std::setprecision(3);
+    for (auto& [name, response] : streams) {
+        cout << name << "：" << response.length()/1e6 << " MB\n";
+        for (auto& [path, path_name] : paths) {
+            if (not LLM::Scanner::use(path)) {
+                cout << "    " << path_name << "：不支持\n";
+                continue;
+            }
+            cout << "    " << path_name << "：" << throughput(response, rounds) << " GB/s\n";
+        }
+    }
+    return 0;
+}
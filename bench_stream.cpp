@@ -0,0 +1,226 @@
+/**
+ * 流式传输的基准测试：在本进程内启动一个模拟的OpenAI兼容服务器，测量每个token从服务器发出到交给回调函数的延迟与相邻token的到达间隔
+ * 比较TCP回环与Unix域套接字，以及curl默认配置(plain)与低延迟流式配置(streaming)
+ * 编译：g++ -std=c++17 -O2 bench_stream.cpp llm.cpp llm_impl.cpp -lcurl，Windows上另加-lws2_32
+ * 2026.10.16
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+
+#include "llm.h"
+
+#ifdef _WIN32
+#include <afunix.h>
+using Socket = SOCKET;
+inline void close_socket(Socket s) { closesocket(s); }
+inline void shutdown_socket(Socket s) { shutdown(s, SD_BOTH); }
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+using Socket = int;
+inline void close_socket(Socket s) { close(s); }
+inline void shutdown_socket(Socket s) { shutdown(s, SHUT_RDWR); }
+#endif
+
+using std::cout;
+using std::string;
+using std::vector;
+using std::chrono::steady_clock;
+using std::chrono::nanoseconds;
+using std::chrono::microseconds;
+
+long long now_ns() { return std::chrono::duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count(); }
+
+class Stand_in {         // Stand_in类是本地的模拟服务器：按固定间隔以SSE逐个发出token，token的内容是发出时刻(纳秒)
+public:
+    Stand_in(int family, size_t tokens, microseconds interval) : family{family}, tokens{tokens}, interval{interval}
+    {
+        listener = socket(family, SOCK_STREAM, 0);
+        if (family == AF_UNIX) {
+            path = (std::filesystem::temp_directory_path()/("llm_bench_"+std::to_string(now_ns())+".sock")).string();
+            sockaddr_un addr {};
+            addr.sun_family = AF_UNIX;
+            path.copy(addr.sun_path, sizeof(addr.sun_path)-1);
+            bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        }
+        else {
+            sockaddr_in addr {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+            socklen_t length {sizeof(addr)};
+            getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &length);
+            port = ntohs(addr.sin_port);
+        }
+        listen(listener, 16);
+        worker = std::thread{[this] { serve(); }};
+    }
+    string url() const { return "http://127.0.0.1:"+std::to_string(port)+"/v1/chat/completions"; }
+    const string& socket_path() const { return path; }
+    ~Stand_in()
+    {
+        stopping = true;
+        shutdown_socket(listener);           // 唤醒阻塞中的accept与recv
+        shutdown_socket(client);
+        worker.join();
+        close_socket(listener);
+        if (not path.empty())
+            std::remove(path.c_str());
+    }
+private:
+    Socket listener;
+    int family;
+    size_t tokens;
+    microseconds interval;
+    int port {};
+    string path;
+    std::atomic<bool> stopping {};
+    std::atomic<Socket> client {};           // 正在服务的连接，客户端的连接池会一直保持它
+    std::thread worker;
+    void serve()             // 依次处理连接，每个连接上可以有多个请求
+    {
+        while (not stopping) {
+            client = accept(listener, nullptr, nullptr);
+            if (stopping)
+                break;
+            if (family == AF_INET) {             // 与常见的API网关一样关闭Nagle算法，测得的差别只来自客户端
+                int on {1};
+                setsockopt(client, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+            }
+            while (respond(client)) ;
+            close_socket(client);
+        }
+    }
+    bool respond(Socket client)          // 读完一个请求并流式返回，返回连接是否仍可用
+    {
+        string request;
+        char buffer[4096];
+        size_t header_end;
+        while ((header_end = request.find("\r\n\r\n")) == string::npos) {
+            int n = recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                return false;
+            request.append(buffer, n);
+        }
+        size_t body {};
+        auto field = request.find("Content-Length:");
+        if (field != string::npos and field < header_end)
+            body = std::strtoul(request.c_str()+field+15, nullptr, 10);
+        for (size_t have {request.length()-header_end-4}; have < body; ) {
+            int n = recv(client, buffer, sizeof(buffer), 0);
+            if (n <= 0)
+                return false;
+            have += n;
+        }
+        if (not send_all(client, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nTransfer-Encoding: chunked\r\n\r\n"))
+            return false;
+        auto next = steady_clock::now();
+        for (size_t i {}; i<=tokens; ++i) {
+            std::this_thread::sleep_until(next);
+            next += interval;
+            string event {(i < tokens) ? R"(data: {"choices":[{"index":0,"delta":{"content":")"+std::to_string(now_ns())+R"("},"finish_reason":null}]})" : R"(data: {"choices":[{"index":0,"delta":{},"finish_reason":"stop"}],"usage":{"prompt_tokens":1,"completion_tokens":1,"total_tokens":2}})"};
+            event.append("\n\n");
+            char size[16];
+            std::snprintf(size, sizeof(size), "%zx\r\n", event.length());
+            if (not send_all(client, size+event+"\r\n"))
+                return false;
+        }
+        return send_all(client, "e\r\ndata: [DONE]\n\n\r\n0\r\n\r\n");
+    }
+    static bool send_all(Socket client, const string& data)
+    {
+        for (size_t sent {}; sent < data.length(); ) {
+            int n = send(client, data.data()+sent, static_cast<int>(data.length()-sent), 0);
+            if (n <= 0)
+                return false;
+            sent += n;
+        }
+        return true;
+    }
+};
+
+struct Latency {             // 一组token延迟的统计，单位微秒
+    double median;
+    double p99;
+    double gap;          // 相邻token到达间隔的中位数
+    double gap_p99;
+};
+
+Latency measure(LLM::LLM& llm, vector<long long>& arrivals, vector<long long>& latencies, int rounds)
+{
+    latencies.clear();
+    vector<long long> gaps;
+    for (int i {}; i<rounds; ++i) {
+        arrivals.clear();
+        llm.get("bench");
+        llm.clear_history();
+        for (size_t j {1}; j<arrivals.size(); ++j)
+            gaps.push_back(arrivals[j]-arrivals[j-1]);
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::sort(gaps.begin(), gaps.end());
+    auto at = [](const vector<long long>& sorted, size_t percent) { return (sorted.empty()) ? 0 : sorted[(sorted.size()-1)*percent/100]/1e3; };
+    return Latency{at(latencies, 50), at(latencies, 99), at(gaps, 50), at(gaps, 99)};
+}
+
+struct Plain : Curl::Curl {          // 忽略传输配置的Curl，保持curl的默认选项作为对照
+    using Curl::Curl;
+    void set_profile(::Curl::Profile) override { }
+};
+
+void report(const string& name, const Latency& latency)
+{
+    cout << std::fixed << std::setprecision(1);
+    cout << "延迟 中位 " << std::setw(8) << latency.median << " us  p99 " << std::setw(8) << latency.p99;
+    cout << " us   间隔 中位 " << std::setw(8) << latency.gap << " us  p99 " << std::setw(8) << latency.gap_p99 << " us   " << name << '\n';
+}
+
+int main(int argc, char* argv[])
+{
+#ifdef _WIN32
+    WSADATA wsa;
+    WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+    size_t tokens {(argc > 1) ? std::strtoul(argv[1], nullptr, 10) : 500};
+    microseconds interval {(argc > 2) ? std::strtol(argv[2], nullptr, 10) : 1000};
+    int rounds {5};
+    vector<long long> arrivals;
+    vector<long long> latencies;
+    auto sink = [&](string&& token) {
+        long long now {now_ns()};
+        arrivals.push_back(now);
+        latencies.push_back(now-std::atoll(token.c_str()));
+    };
+    cout << tokens << "个token，间隔" << interval.count() << "us，" << rounds << "轮\n";
+    {
+        Stand_in server {AF_INET, tokens, interval};          // 每种配置使用新的服务器，连接不会沿用之前配置的套接字选项
+        LLM::Chat llm {server.url(),"bench","key",sink,CP_UTF8,CP_UTF8};
+        llm.set_transport([](const string& url, const string& unix_socket) { return std::unique_ptr<Curl::Transport>{new Plain{url,unix_socket}}; });
+        report("TCP回环 plain", measure(llm, arrivals, latencies, rounds));
+    }
+    {
+        Stand_in server {AF_INET, tokens, interval};
+        LLM::Chat llm {server.url(),"bench","key",sink,CP_UTF8,CP_UTF8};
+        report("TCP回环 streaming", measure(llm, arrivals, latencies, rounds));
+    }
+    {
+        Stand_in server {AF_UNIX, tokens, interval};
+        LLM::Chat llm {"http://localhost/v1/chat/completions","bench","key",sink,CP_UTF8,CP_UTF8,string{server.socket_path()}};
+        report("Unix域套接字 streaming", measure(llm, arrivals, latencies, rounds));
+    }
+    return 0;
+}
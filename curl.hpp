@@ -3,7 +3,21 @@
 
 #include <string>
 #include <string_view>
+#include <algorithm>
 #include <memory>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <deque>
+#include <optional>
+#include <random>
+#include <thread>
+#include <ctime>
+#include <cctype>
+#include <cstdlib>
 
 #include <curl.h>
 
@@ -13,54 +27,797 @@ namespace Curl {             // 该名字空间负责简单封装网络连接库
     using std::string_view;
     using std::unique_ptr;
     using std::nothrow;
+    using std::shared_ptr;
+    using std::list;
+    using std::vector;
+    using std::mutex;
+    using std::lock_guard;
+    using std::chrono::steady_clock;
+    using std::chrono::seconds;
+    using std::function;
+    using std::map;
+    using std::deque;
+    using std::multimap;
+    using std::optional;
+    using std::chrono::milliseconds;
     
-    struct Network_error {};             // 网络连接异常
+    struct Result {          // 一次请求的传输结果
+        CURLcode code {CURLE_OK};            // curl的结果码
+        long status {};          // HTTP状态码，未收到响应时为0
+        long retry_after {-1};       // 服务器在Retry-After中给出的等待秒数，未给出时为-1
+        bool ok() const { return code==CURLE_OK and status>=200 and status<300; }
+    };
+    
+    struct Network_error {             // 网络连接异常
+        Result result {CURLE_FAILED_INIT};
+    };
+    
+    class Retry_policy {         // Retry_policy类是带随机抖动的指数退避重试策略，优先遵从服务器的Retry-After
+    public:
+        explicit Retry_policy(int attempts =3, milliseconds base =milliseconds{500}, milliseconds cap =milliseconds{20000}) : max_attempts{attempts}, base{base}, cap{cap} { }
+        static bool retryable(const Result& result)          // 是否是重试可能成功的失败：连接与传输中断、请求超时、限流和服务器暂时不可用
+        {
+            switch (result.status) {
+            case 408:
+            case 429:
+            case 500:
+            case 502:
+            case 503:
+            case 504:
+                return true;
+            default:
+                break;
+            }
+            switch (result.code) {
+            case CURLE_COULDNT_RESOLVE_HOST:
+            case CURLE_COULDNT_CONNECT:
+            case CURLE_OPERATION_TIMEDOUT:
+            case CURLE_SSL_CONNECT_ERROR:
+            case CURLE_GOT_NOTHING:
+            case CURLE_SEND_ERROR:
+            case CURLE_RECV_ERROR:
+            case CURLE_PARTIAL_FILE:
+                return true;
+            default:
+                return false;
+            }
+        }
+        optional<milliseconds> next_delay(int attempt, const Result& result) const       // 第attempt次尝试(从0计)失败后，返回再次尝试前的等待时间。不应重试时返回空
+        {
+            if (attempt+1>=max_attempts or not retryable(result))
+                return {};
+            if (result.retry_after >= 0) {
+                milliseconds wait {seconds{result.retry_after}};
+                return (wait<=cap) ? optional<milliseconds>{wait} : optional<milliseconds>{};      // 服务器要求等待太久就不再重试
+            }
+            milliseconds ceiling {(attempt<20) ? std::min(cap, base*(1<<attempt)) : cap};
+            std::uniform_int_distribution<long long> jitter {ceiling.count()/2, ceiling.count()};      // 等量抖动，避免大量请求同时重试
+            return milliseconds{jitter(random_engine())};
+        }
+        int attempts() const { return max_attempts; }
+    private:
+        int max_attempts;            // 包括第一次在内的最多尝试次数，为1时不重试
+        milliseconds base;
+        milliseconds cap;
+        static std::mt19937& random_engine()
+        {
+            thread_local std::mt19937 engine {std::random_device{}()};
+            return engine;
+        }
+    };
+    
+    class Pool {         // Pool类是按(协议, 主机, 端口)划分的空闲easy句柄池。句柄保留着已建立的长连接和TLS会话，复用时可跳过DNS、TCP与TLS握手
+    public:
+        struct Handle {          // easy句柄及阻塞执行它的私有curl_multi，长连接缓存在后者中
+            CURL* easy {};
+            CURLM* multi {};             // 首次阻塞执行时才创建
+        };
+        Pool() =default;
+        Pool(const Pool&) =delete;
+        Pool& operator=(const Pool&) =delete;
+        Handle acquire(const string& host)           // 取出一个连向host的空闲句柄，没有则新建一个。失败时easy为空指针
+        {
+            Handle handle {};
+            vector<Handle> expired;
+            {
+                lock_guard<mutex> lock {m};
+                reap(expired);
+                for (auto i=idle.rbegin(); i!=idle.rend(); ++i)          // 最近归还的连接最有可能仍然存活
+                    if (i->host == host) {
+                        handle = i->handle;
+                        idle.erase(std::next(i).base());
+                        break;
+                    }
+            }
+            cleanup(expired);
+            if (not handle.easy)
+                return Handle{curl_easy_init(),nullptr};
+            curl_easy_reset(handle.easy);             // 重置选项，但保留连接缓存、TLS会话缓存和DNS缓存
+            return handle;
+        }
+        void release(const string& host, Handle handle)            // 归还句柄，超出空闲上限时关闭最久未用的句柄
+        {
+            vector<Handle> expired;
+            {
+                lock_guard<mutex> lock {m};
+                idle.push_back(Idle{host,handle,steady_clock::now()});
+                reap(expired);
+            }
+            cleanup(expired);
+        }
+        void reap()          // 关闭空闲超时的句柄
+        {
+            vector<Handle> expired;
+            {
+                lock_guard<mutex> lock {m};
+                reap(expired);
+            }
+            cleanup(expired);
+        }
+        void set_max_idle(size_t max)          // 设置空闲句柄数上限，为0时不再保留任何句柄
+        {
+            {
+                lock_guard<mutex> lock {m};
+                max_idle = max;
+            }
+            reap();
+        }
+        void set_idle_timeout(seconds timeout)             // 设置空闲超时，应短于服务器关闭空闲连接的时间
+        {
+            {
+                lock_guard<mutex> lock {m};
+                idle_timeout = timeout;
+            }
+            reap();
+        }
+        void clear() { set_max_idle(0); }          // 关闭所有空闲句柄
+        ~Pool()
+        {
+            for (auto& i : idle)
+                close(i.handle);
+        }
+    private:
+        struct Idle {
+            string host;
+            Handle handle;
+            steady_clock::time_point since;
+        };
+        mutex m;
+        list<Idle> idle;             // 按归还时间排序，最早归还的在前
+        size_t max_idle {16};
+        seconds idle_timeout {50};
+        void reap(vector<Handle>& expired)             // 摘下超时或超出上限的句柄，调用者需持有锁
+        {
+            auto deadline = steady_clock::now()-idle_timeout;
+            while (not idle.empty() and (idle.size()>max_idle or idle.front().since<deadline)) {
+                expired.push_back(idle.front().handle);
+                idle.pop_front();
+            }
+        }
+        static void cleanup(const vector<Handle>& expired)             // 在锁外关闭句柄，关闭TLS连接可能需要收发数据
+        {
+            for (auto& handle : expired)
+                close(handle);
+        }
+        static void close(const Handle& handle)
+        {
+            if (handle.multi)
+                curl_multi_cleanup(handle.multi);
+            curl_easy_cleanup(handle.easy);
+        }
+    };
     
-    class Global_resource {        // Global_resource类是一个全局网络环境初始化状态
+    class Global_resource {        // Global_resource类是一个全局网络环境初始化状态，并持有所有Curl共享的DNS缓存与TLS会话缓存。curl不支持多线程同时使用共享的连接缓存，连接的复用交给Pool与Multi
     public:
-        Global_resource() { curl_global_init(CURL_GLOBAL_DEFAULT); }
-        ~Global_resource() { curl_global_cleanup(); }
+        Global_resource()
+        {
+            curl_global_init(CURL_GLOBAL_DEFAULT);
+            share_ptr = curl_share_init();
+            if (share_ptr) {
+                curl_share_setopt(share_ptr, CURLSHOPT_LOCKFUNC, lock);
+                curl_share_setopt(share_ptr, CURLSHOPT_UNLOCKFUNC, unlock);
+                curl_share_setopt(share_ptr, CURLSHOPT_USERDATA, this);
+                curl_share_setopt(share_ptr, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+                curl_share_setopt(share_ptr, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+            }
+        }
+        Pool& pool() { return handle_pool; }
+        CURLSH* share() const { return share_ptr; }          // 共享对象，创建失败时为空指针，此时各连接各自缓存
+        ~Global_resource()
+        {
+            handle_pool.clear();
+            curl_share_cleanup(share_ptr);
+            curl_global_cleanup();
+        }
+    private:
+        Pool handle_pool;
+        CURLSH* share_ptr;
+        mutex locks[CURL_LOCK_DATA_LAST];            // 每类共享数据一把锁
+        static void lock(CURL*, curl_lock_data data, curl_lock_access, void* global) { static_cast<Global_resource*>(global)->locks[data].lock(); }
+        static void unlock(CURL*, curl_lock_data data, void* global) { static_cast<Global_resource*>(global)->locks[data].unlock(); }
     };
     
-    class Curl {             // Curl类是一个网络连接。注意处理抛出的Network_error异常
+    enum class Profile { plain, streaming };             // 传输配置：plain为curl默认值，streaming为低延迟流式传输
+    
+    class Transport {            // Transport类是执行一次请求的方式，Curl经网络传输，Mock在进程内回放脚本化的响应。注意处理抛出的Network_error异常
     public:
-        explicit Curl(string_view url) : url{url}, headers{}
+        using Header_list = shared_ptr<curl_slist>;            // 可在多个请求间共享的请求头列表
+        using Read_func = function<size_t(char*, size_t)>;           // 请求体的数据源：向缓冲区写入至多size字节并返回写入的字节数，返回0表示请求体结束
+        using Factory = function<unique_ptr<Transport>(const string& url, const string& unix_socket)>;           // 为一次请求创建传输对象
+        virtual void set_headers(Header_list list) = 0;
+        virtual void set_body(string&& json) = 0;
+        virtual void set_body(Read_func source) = 0;
+        virtual void set_write_func(void* call_back_func) = 0;           // 响应数据的回调，形如size_t(char* data, size_t size, size_t nmemb, void* write_data)，返回值不等于size*nmemb时中止请求
+        virtual void set_write_data(void* buffer) = 0;
+        virtual void set_progress_func(void* call_back_func) = 0;          // 传输期间定期调用的函数，形如int(void* progress_data, curl_off_t, curl_off_t, curl_off_t, curl_off_t)，返回非0时中止请求
+        virtual void set_progress_data(void* data) = 0;
+        virtual void set_timer_func(void* call_back_func) = 0;             // 进度回调下一次必须被调用的时刻，形如long(void* progress_data)，返回距该时刻的毫秒数，负数表示没有。执行请求的事件循环到时调用进度回调，curl自己在没有数据时约每秒才调用一次
+        virtual void set_profile(Profile profile) = 0;
+        virtual void set_connect_timeout(milliseconds timeout) = 0;
+        virtual Result perform() = 0;            // 执行请求，返回传输结果
+        virtual Result warmup() = 0;             // 提前建立连接
+        virtual ~Transport() { }
+    };
+    
+    class Curl : public Transport {             // Curl类是一个网络连接。注意处理抛出的Network_error异常
+    public:
+        explicit Curl(string_view url, string_view unix_socket ={}) : url{url}, unix_socket{unix_socket}, host{host_of(this->url, this->unix_socket)}          // unix_socket非空时经该Unix域套接字连接，url仍决定请求的路径与Host。libcurl不支持Unix域套接字时抛出Network_error
         {
             if (not global_init())
                 throw Network_error{};
-            ptr = curl_easy_init();
+            if (not this->unix_socket.empty() and not supports(CURL_VERSION_UNIX_SOCKETS))          // 随附的Windows版libcurl 7.64.1编译时未启用Unix域套接字，需换用启用了的版本
+                throw Network_error{Result{CURLE_UNSUPPORTED_PROTOCOL}};
+            Pool::Handle handle {pool().acquire(host)};
+            ptr = handle.easy;
+            own = handle.multi;
             if (not ptr)
                 throw Network_error{};
+            curl_easy_setopt(ptr, CURLOPT_SHARE, global_init()->share());
         }
-        void add_header(const string& name, const string& value) { headers = curl_slist_append(headers, (name+": "+value).c_str()); }
-        void set_body(string&& json) { body = std::move(json); }
-        void set_write_func(void* call_back_func) { curl_easy_setopt(ptr, CURLOPT_WRITEFUNCTION, call_back_func); }
-        void set_write_data(void* buffer) { curl_easy_setopt(ptr, CURLOPT_WRITEDATA, buffer); }
-        void perform() const             // 执行网络请求
+        Curl(Curl&& other) : ptr{other.ptr}, own{other.own}, url{std::move(other.url)}, unix_socket{std::move(other.unix_socket)}, host{std::move(other.host)}, headers{std::move(other.headers)}, body{std::move(other.body)}, body_source{std::move(other.body_source)}, retry_after{other.retry_after}, progress_func{other.progress_func}, progress_data{other.progress_data}, timer_func{other.timer_func}
         {
-            curl_easy_setopt(ptr, CURLOPT_URL, url.c_str());
-            curl_easy_setopt(ptr, CURLOPT_HTTPHEADER, headers);
-            if (not body.empty()) {
-                curl_easy_setopt(ptr, CURLOPT_POSTFIELDS, body.c_str());
-                curl_easy_setopt(ptr, CURLOPT_POSTFIELDSIZE, body.length());
+            other.ptr = nullptr;
+            other.own = nullptr;
+        }
+        Curl(const Curl&) =delete;
+        Curl& operator=(const Curl&) =delete;
+        static Header_list make_headers(const vector<string>& lines)           // 预先生成请求头列表，每行形如"Name: value"
+        {
+            Header_list list;
+            for (auto& line : lines)
+                append(list, line);
+            return list;
+        }
+        void set_headers(Header_list list) override { headers = std::move(list); }          // 使用共享的请求头列表，之后再add_header会先复制一份
+        void add_header(const string& name, const string& value)
+        {
+            if (headers.use_count() > 1) {
+                Header_list copy;
+                for (curl_slist* i {headers.get()}; i; i=i->next)
+                    append(copy, i->data);
+                headers = std::move(copy);
             }
-            curl_easy_perform(ptr);
+            append(headers, name+": "+value);
+        }
+        void set_body(string&& json) override { body = std::move(json); }
+        void set_body(Read_func source) override { body_source = std::move(source); }          // 流式上传请求体，HTTP/1.1下使用分块传输编码。请求头中应有"Expect:"，否则curl会先等待100 Continue
+        void set_write_func(void* call_back_func) override { curl_easy_setopt(ptr, CURLOPT_WRITEFUNCTION, call_back_func); }
+        void set_write_data(void* buffer) override { curl_easy_setopt(ptr, CURLOPT_WRITEDATA, buffer); }
+        void set_progress_func(void* call_back_func) override          // 设置传输期间定期调用的函数，它返回非0时中止请求
+        {
+            progress_func = reinterpret_cast<Progress_func>(call_back_func);
+            curl_easy_setopt(ptr, CURLOPT_XFERINFOFUNCTION, call_back_func);
+            curl_easy_setopt(ptr, CURLOPT_NOPROGRESS, 0L);
+        }
+        void set_progress_data(void* data) override
+        {
+            progress_data = data;
+            curl_easy_setopt(ptr, CURLOPT_XFERINFODATA, data);
+        }
+        void set_timer_func(void* call_back_func) override { timer_func = reinterpret_cast<Timer_func>(call_back_func); }
+        void set_profile(Profile profile) override          // 应用传输配置。连接建立时才确定套接字选项，预热连接也应使用相同配置
+        {
+            if (profile != Profile::streaming)
+                return;
+            curl_easy_setopt(ptr, CURLOPT_TCP_NODELAY, 1L);            // 关闭Nagle算法，小的SSE事件立即发出
+            curl_easy_setopt(ptr, CURLOPT_TCP_KEEPALIVE, 1L);            // 保持池中的空闲连接，并尽早发现已断开的连接
+            curl_easy_setopt(ptr, CURLOPT_TCP_KEEPIDLE, 30L);
+            curl_easy_setopt(ptr, CURLOPT_TCP_KEEPINTVL, 15L);
+            curl_easy_setopt(ptr, CURLOPT_BUFFERSIZE, 64L*1024);           // 积压的多个事件一次读完，减少回调次数
+            curl_easy_setopt(ptr, CURLOPT_UPLOAD_BUFFERSIZE, 64L*1024);          // 流式上传时每次读取更多请求体
+            curl_easy_setopt(ptr, CURLOPT_DNS_CACHE_TIMEOUT, 600L);            // 共享DNS缓存保留更久
+            curl_easy_setopt(ptr, CURLOPT_HAPPY_EYEBALLS_TIMEOUT_MS, 100L);
+            curl_easy_setopt(ptr, CURLOPT_ACCEPT_ENCODING, nullptr);           // 不请求压缩，压缩会让服务器攒够数据才发出
+        }
+        void set_connect_timeout(milliseconds timeout) override { curl_easy_setopt(ptr, CURLOPT_CONNECTTIMEOUT_MS, static_cast<long>(timeout.count())); }
+        Result perform() override             // 执行网络请求，返回传输结果
+        {
+            prepare();
+            return result(run());
+        }
+        Result warmup() override          // 以HEAD请求建立到url的连接，句柄归还Pool后连接留在其中，之后连向同一主机的请求可直接复用
+        {
+            curl_easy_setopt(ptr, CURLOPT_URL, url.c_str());
+            use_socket();
+            curl_easy_setopt(ptr, CURLOPT_NOBODY, 1L);
+            return result(run());
+        }
+        static bool supports(int feature)            // 所用的libcurl是否具备某项功能，feature为CURL_VERSION_*
+        {
+            curl_version_info_data* info {curl_version_info(CURLVERSION_NOW)};
+            return info and (info->features&feature);
+        }
+        static Pool& pool()          // 进程内共享的句柄池，所有Curl对象从中取用句柄
+        {
+            Global_resource* global {global_init()};
+            if (not global)
+                throw Network_error{};
+            return global->pool();
         }
-        ~Curl()
+        ~Curl() override
         {
-            curl_slist_free_all(headers);
-            curl_easy_cleanup(ptr);
+            if (ptr)
+                pool().release(host, Pool::Handle{ptr,own});
         }
     private:
+        friend class Multi;
+        using Progress_func = int(*)(void*, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+        using Timer_func = long(*)(void*);
         CURL* ptr;
+        CURLM* own;          // 阻塞执行用的私有curl_multi，尚未阻塞执行过时为空
         string url;
-        curl_slist* headers;
+        string unix_socket;
+        string host;             // 连接池的键，形如scheme://host:port，经Unix域套接字连接时前缀套接字路径
+        Header_list headers;
         string body;
-        static const Global_resource* global_init()        // 提供全局网络环境初始化状态
+        Read_func body_source;
+        long retry_after {-1};
+        Progress_func progress_func {};
+        void* progress_data {};
+        Timer_func timer_func {};
+        static Global_resource* global_init()        // 提供全局网络环境初始化状态
         {
             static unique_ptr<Global_resource> global {new(nothrow) Global_resource};
             return global.get();
         }
+        void use_socket()          // 设置经unix_socket连接。设置失败时抛出Network_error，不能退回TCP，否则请求连同密钥会发往url所指的主机
+        {
+            if (not unix_socket.empty() and curl_easy_setopt(ptr, CURLOPT_UNIX_SOCKET_PATH, unix_socket.c_str())!=CURLE_OK)
+                throw Network_error{Result{CURLE_UNSUPPORTED_PROTOCOL}};
+        }
+        void prepare()             // 设置请求选项。选项引用了成员的内存，设置后对象不能再移动
+        {
+            retry_after = -1;
+            curl_easy_setopt(ptr, CURLOPT_URL, url.c_str());
+            use_socket();
+            curl_easy_setopt(ptr, CURLOPT_HTTPHEADER, headers.get());
+            curl_easy_setopt(ptr, CURLOPT_HEADERFUNCTION, header_call_back);
+            curl_easy_setopt(ptr, CURLOPT_HEADERDATA, this);
+            if (body_source) {
+                curl_easy_setopt(ptr, CURLOPT_POST, 1L);
+                curl_easy_setopt(ptr, CURLOPT_READFUNCTION, read_call_back);
+                curl_easy_setopt(ptr, CURLOPT_READDATA, this);
+            }
+            else if (not body.empty()) {
+                curl_easy_setopt(ptr, CURLOPT_POSTFIELDS, body.c_str());
+                curl_easy_setopt(ptr, CURLOPT_POSTFIELDSIZE, body.length());
+            }
+        }
+        CURLcode run()           // 在私有的curl_multi中阻塞执行请求，与curl_easy_perform相同，但按定时回调准时调用进度回调。连接留在私有的curl_multi中，下次执行时复用
+        {
+            if (not own)
+                own = curl_multi_init();
+            if (not own or curl_multi_add_handle(own, ptr)!=CURLM_OK)
+                throw Network_error{};
+            CURLcode code {CURLE_OK};
+            for (bool done {}; not done; ) {
+                int running {};
+                if (curl_multi_perform(own, &running) != CURLM_OK) {
+                    code = CURLE_FAILED_INIT;
+                    break;
+                }
+                int left {};
+                while (CURLMsg* msg {curl_multi_info_read(own, &left)})
+                    if (msg->msg==CURLMSG_DONE and msg->easy_handle==ptr) {
+                        code = msg->data.result;
+                        done = true;
+                    }
+                if (not done and call_progress()) {
+                    code = CURLE_ABORTED_BY_CALLBACK;
+                    break;
+                }
+                if (not done)
+                    wait(own, next_progress(1000));
+            }
+            curl_multi_remove_handle(own, ptr);
+            return code;
+        }
+        int next_progress(int limit) const             // 距进度回调下一次必须被调用的毫秒数，不超过limit
+        {
+            long next {(timer_func) ? timer_func(progress_data) : -1};
+            return (next<0 or next>limit) ? limit : static_cast<int>(next);
+        }
+        bool call_progress()             // 定时已到就调用进度回调，返回是否应中止请求
+        {
+            return timer_func and progress_func and timer_func(progress_data)==0 and progress_func(progress_data, 0, 0, 0, 0)!=0;
+        }
+        static void wait(CURLM* multi, int timeout_ms)           // 等待套接字上的事件，最多timeout_ms毫秒。没有可等待的套接字(如解析域名期间)时curl_multi_wait立即返回，此时睡到curl自己的下一次超时，避免空转
+        {
+            auto until = steady_clock::now()+milliseconds{timeout_ms};
+            int events {};
+            if (curl_multi_wait(multi, nullptr, 0, timeout_ms, &events)!=CURLM_OK or events)
+                return;
+            long next {-1};
+            curl_multi_timeout(multi, &next);
+            std::this_thread::sleep_until((next < 0) ? until : std::min(until, steady_clock::now()+milliseconds{next}));
+        }
+        static void append(Header_list& list, const string& line)
+        {
+            curl_slist* appended {curl_slist_append(list.get(), line.c_str())};
+            if (appended and not list)
+                list.reset(appended, curl_slist_free_all);
+        }
+        Result result(CURLcode code) const             // 汇总请求结束后的传输结果
+        {
+            long status {};
+            curl_easy_getinfo(ptr, CURLINFO_RESPONSE_CODE, &status);
+            return Result{code,status,retry_after};
+        }
+        static size_t read_call_back(char* buffer, size_t size, size_t nitems, Curl* curl)           // 向curl提供请求体
+        {
+            try {
+                return curl->body_source(buffer, size*nitems);
+            }
+            catch (...) {          // 异常不能穿过curl
+                return CURL_READFUNC_ABORT;
+            }
+        }
+        static size_t header_call_back(char* buffer, size_t size, size_t nitems, Curl* curl)             // 逐行处理响应头，记录Retry-After
+        {
+            string_view line {buffer, size*nitems};
+            constexpr string_view name {"retry-after:"};
+            if (line.substr(0, 5) == "HTTP/")          // 新的响应(如重定向后)，丢弃之前的记录
+                curl->retry_after = -1;
+            else if (line.length()>name.length() and std::equal(name.begin(), name.end(), line.begin(), [](char a, char b) { return a==std::tolower(static_cast<unsigned char>(b)); })) {
+                string value {line.substr(name.length())};
+                auto first = value.find_first_not_of(" \t");
+                auto last = value.find_last_not_of(" \t\r\n");
+                if (first==string::npos)
+                    return size*nitems;
+                value = value.substr(first, last-first+1);
+                if (std::isdigit(static_cast<unsigned char>(value.front())))          // 秒数
+                    curl->retry_after = std::strtol(value.c_str(), nullptr, 10);
+                else {           // HTTP日期
+                    time_t when {curl_getdate(value.c_str(), nullptr)};
+                    if (when != -1)
+                        curl->retry_after = std::max(0L, static_cast<long>(when-std::time(nullptr)));
+                }
+            }
+            return size*nitems;
+        }
+        static string host_of(const string& url, const string& unix_socket)             // 提取url的协议、主机和端口，解析失败时以整个url为键
+        {
+            if (not unix_socket.empty())
+                return "unix:"+unix_socket+'|'+host_of(url, {});
+            CURLU* parts {curl_url()};
+            if (not parts)
+                return url;
+            string host {url};
+            char* scheme {};
+            char* name {};
+            char* port {};
+            if (curl_url_set(parts, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK
+                    and curl_url_get(parts, CURLUPART_SCHEME, &scheme, 0) == CURLUE_OK
+                    and curl_url_get(parts, CURLUPART_HOST, &name, 0) == CURLUE_OK
+                    and curl_url_get(parts, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK)
+                host = string{scheme}+"://"+name+':'+port;
+            curl_free(scheme);
+            curl_free(name);
+            curl_free(port);
+            curl_url_cleanup(parts);
+            return host;
+        }
+    };
+    
+    struct Script {          // Mock回放的响应：chunks的划分即写回调每次收到的数据，相邻两块之间间隔pacing
+        vector<string> chunks;
+        milliseconds pacing {};
+        long status {200};
+        static Script split(string_view response, size_t chunk_size, milliseconds pacing ={}, long status =200)          // 把完整的响应按每chunk_size字节切块
+        {
+            Script script {{},pacing,status};
+            if (chunk_size == 0)
+                chunk_size = response.length();
+            for (size_t i {}; i<response.length(); i+=chunk_size)
+                script.chunks.emplace_back(response.substr(i, chunk_size));
+            return script;
+        }
+    };
+    
+    class Mock : public Transport {          // Mock类在进程内把脚本化的响应直接交给写回调，不经过网络，用于测试和剖析流式解析的开销
+    public:
+        explicit Mock(shared_ptr<const Script> script) : script{std::move(script)} { }
+        static Factory factory(Script script)          // 每次请求都回放同一脚本的传输方式，交给LLM::set_transport
+        {
+            shared_ptr<const Script> shared {new Script{std::move(script)}};
+            return [shared](const string&, const string&) { return unique_ptr<Transport>{new Mock{shared}}; };
+        }
+        void set_headers(Header_list) override { }
+        void set_body(string&& json) override { body = std::move(json); }
+        void set_body(Read_func source) override { body_source = std::move(source); }
+        void set_write_func(void* call_back_func) override { write_func = reinterpret_cast<Write_func>(call_back_func); }
+        void set_write_data(void* buffer) override { write_data = buffer; }
+        void set_progress_func(void* call_back_func) override { progress_func = reinterpret_cast<Progress_func>(call_back_func); }
+        void set_progress_data(void* data) override { progress_data = data; }
+        void set_timer_func(void* call_back_func) override { timer_func = reinterpret_cast<Timer_func>(call_back_func); }
+        void set_profile(Profile) override { }
+        void set_connect_timeout(milliseconds) override { }
+        Result perform() override          // 读完请求体后逐块回放响应，与curl一样在每块之前检查进度回调，块之间的等待中按定时回调调用进度回调
+        {
+            if (body_source) {
+                char buffer[16*1024];
+                try {
+                    while (body_source(buffer, sizeof(buffer))) ;
+                }
+                catch (...) {          // 与curl一样，数据源出错时中止请求
+                    return Result{CURLE_ABORTED_BY_CALLBACK};
+                }
+            }
+            for (size_t i {}; i<script->chunks.size(); ++i) {
+                if (i and script->pacing.count() and not pause(steady_clock::now()+script->pacing))
+                    return Result{CURLE_ABORTED_BY_CALLBACK,script->status};
+                if (progress_func and progress_func(progress_data, 0, 0, 0, 0))
+                    return Result{CURLE_ABORTED_BY_CALLBACK,script->status};
+                const string& chunk {script->chunks[i]};
+                if (write_func and write_func(const_cast<char*>(chunk.data()), 1, chunk.length(), write_data)!=chunk.length())
+                    return Result{CURLE_WRITE_ERROR,script->status};
+            }
+            return Result{CURLE_OK,script->status};
+        }
+        Result warmup() override { return Result{CURLE_OK,script->status}; }
+    private:
+        using Write_func = size_t(*)(char*, size_t, size_t, void*);
+        using Progress_func = int(*)(void*, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+        using Timer_func = long(*)(void*);
+        shared_ptr<const Script> script;
+        string body;
+        Read_func body_source;
+        Write_func write_func {};
+        void* write_data {};
+        Progress_func progress_func {};
+        void* progress_data {};
+        Timer_func timer_func {};
+        bool pause(steady_clock::time_point until)           // 等到until，其间定时已到就调用进度回调。返回是否继续
+        {
+            for (auto now = steady_clock::now(); now<until; now=steady_clock::now()) {
+                long next {(timer_func) ? timer_func(progress_data) : -1};
+                if (next==0 and progress_func) {
+                    if (progress_func(progress_data, 0, 0, 0, 0))
+                        return false;
+                    continue;
+                }
+                std::this_thread::sleep_until((next < 0) ? until : std::min(until, now+milliseconds{next}));
+            }
+            return true;
+        }
+    };
+    
+    class Multi {        // Multi类是基于curl_multi的事件循环，在一个线程中同时驱动大量请求。注意处理抛出的Network_error异常
+    public:
+        using Done_func = function<void(const Result&)>;             // 请求结束时的回调，参数是该请求的传输结果
+        Multi()
+        {
+            if (not Curl::global_init())
+                throw Network_error{};
+            ptr = curl_multi_init();
+            if (not ptr)
+                throw Network_error{};
+        }
+        Multi(const Multi&) =delete;
+        Multi& operator=(const Multi&) =delete;
+        bool set_http2(size_t streams =100, size_t connections =4)           // 开启HTTP/2多路复用：同一主机的并发请求共用连接。进行中的请求每满streams个就让下一个请求新开一个连接，每个主机最多connections个连接，即最多同时执行streams*connections个请求，超出的请求排队等待。libcurl不支持HTTP/2时返回false且不做任何改动，随附的Windows版libcurl 7.64.1未带nghttp2，需换用带HTTP/2的版本。libcurl早于7.67时无法限制每个连接的流数，新请求可能被排到已满的连接上，此时每个主机只用一个连接，connections不起作用
+        {
+            if (not Curl::supports(CURL_VERSION_HTTP2))
+                return false;
+            max_streams = (streams) ? streams : 1;
+            max_connections = 1;
+#if LIBCURL_VERSION_NUM >= 0x074300
+            if (curl_multi_setopt(ptr, CURLMOPT_MAX_CONCURRENT_STREAMS, static_cast<long>(max_streams)) == CURLM_OK)
+                max_connections = (connections) ? connections : 1;
+#endif
+            curl_multi_setopt(ptr, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+            return true;
+        }
+        void add(unique_ptr<Transport>&& transport, Done_func done)          // 加入一个请求，它在run或run_once中执行，结束后调用done。非Curl的请求在run_once中依次阻塞执行
+        {
+            queue(make_transfer(std::move(transport), std::move(done)));
+        }
+        void add(unique_ptr<Transport>&& transport, Done_func done, milliseconds delay)          // 加入一个请求，至少等待delay后才开始执行，用于退避重试
+        {
+            delayed.emplace(steady_clock::now()+delay, make_transfer(std::move(transport), std::move(done)));
+        }
+        void add_wait(function<bool()> ready, function<void()> then)             // 加入一次等待：每次run_once都检查ready，它返回true后调用then，then中可以加入新请求。用于等待其他线程中的工作而不阻塞事件循环，有等待时run_once每次最多阻塞10毫秒
+        {
+            waits.push_back(Wait{std::move(ready),std::move(then)});
+        }
+        void add(Curl&& curl, Done_func done) { add(unique_ptr<Transport>{new Curl{std::move(curl)}}, std::move(done)); }
+        void add(Curl&& curl, Done_func done, milliseconds delay) { add(unique_ptr<Transport>{new Curl{std::move(curl)}}, std::move(done), delay); }
+        size_t size() const          // 未结束的请求数，包括排队中和等待中的请求，以及add_wait加入的等待
+        {
+            size_t count {transfers.size()+local.size()+delayed.size()+waits.size()};
+            for (auto& i : pending)
+                count += i.second.size();
+            return count;
+        }
+        bool run_once(int timeout_ms =1000)        // 推进所有请求并处理已结束的请求，没有事件时最多等待timeout_ms毫秒，请求的定时回调要求更早调用进度回调时只等到那时。返回是否仍有未结束的请求
+        {
+            auto now = steady_clock::now();
+            while (not delayed.empty() and delayed.begin()->first<=now) {
+                unique_ptr<Transfer> transfer {std::move(delayed.begin()->second)};
+                delayed.erase(delayed.begin());
+                queue(std::move(transfer));
+            }
+            bool finished {perform_local()};
+            int running {};
+            if (curl_multi_perform(ptr, &running) != CURLM_OK)
+                throw Network_error{};
+            finished = finish() or finished;
+            finished = expire() or finished;
+            finished = resume() or finished;
+            if (transfers.empty() and local.empty() and delayed.empty() and waits.empty())
+                return false;
+            if (finished)            // 先把控制权交还调用者，回调中加入的请求也要先经curl_multi_perform启动才能等待
+                return true;
+            if (not delayed.empty()) {
+                auto wait = std::chrono::duration_cast<milliseconds>(delayed.begin()->first-steady_clock::now()).count()+1;
+                timeout_ms = static_cast<int>(std::max(0LL, std::min(static_cast<long long>(timeout_ms), static_cast<long long>(wait))));
+            }
+            for (auto& i : transfers)
+                timeout_ms = i.second->curl->next_progress(timeout_ms);
+            if (not waits.empty())
+                timeout_ms = std::min(timeout_ms, 10);
+            if (transfers.empty())           // 没有进行中的请求时curl_multi_wait不会等待
+                std::this_thread::sleep_for(milliseconds{timeout_ms});
+            else
+                Curl::wait(ptr, timeout_ms);
+            return true;
+        }
+        void run() { while (run_once()) ; }          // 执行所有请求直到全部结束
+        ~Multi()
+        {
+            for (auto& i : transfers)
+                curl_multi_remove_handle(ptr, i.first);
+            transfers.clear();
+            local.clear();
+            pending.clear();
+            delayed.clear();
+            waits.clear();
+            curl_multi_cleanup(ptr);
+        }
+    private:
+        struct Transfer {
+            unique_ptr<Transport> transport;
+            Curl* curl;          // 经curl_multi执行时指向transport，否则为空
+            Done_func done;
+        };
+        struct Wait {
+            function<bool()> ready;
+            function<void()> then;
+        };
+        CURLM* ptr;
+        map<CURL*, unique_ptr<Transfer>> transfers;
+        deque<unique_ptr<Transfer>> local;           // 等待阻塞执行的非Curl请求
+        size_t max_streams {};             // 为0表示未开启多路复用
+        size_t max_connections {};
+        map<string, size_t> active;          // 每个主机正在执行的请求数
+        map<string, size_t> connections;             // 每个主机为多路复用开过的连接数，该主机没有进行中的请求时清零
+        map<string, deque<unique_ptr<Transfer>>> pending;          // 每个主机排队中的请求
+        multimap<steady_clock::time_point, unique_ptr<Transfer>> delayed;          // 等待到期的请求
+        vector<Wait> waits;
+        static unique_ptr<Transfer> make_transfer(unique_ptr<Transport>&& transport, Done_func&& done)
+        {
+            if (not transport)
+                throw Network_error{};
+            Curl* curl {dynamic_cast<Curl*>(transport.get())};
+            return unique_ptr<Transfer>{new Transfer{std::move(transport),curl,std::move(done)}};
+        }
+        void queue(unique_ptr<Transfer>&& transfer)          // 启动请求，若该主机的流已满则排队
+        {
+            if (not transfer->curl)
+                local.push_back(std::move(transfer));
+            else if (max_streams and active[transfer->curl->host]>=max_streams*max_connections)
+                pending[transfer->curl->host].push_back(std::move(transfer));
+            else
+                start(std::move(transfer));
+        }
+        void start(unique_ptr<Transfer>&& transfer)          // 把请求交给curl_multi
+        {
+            CURL* handle {transfer->curl->ptr};
+            const string& host {transfer->curl->host};
+            transfer->curl->prepare();
+            if (max_streams) {
+                if (curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS) != CURLE_OK)
+                    throw Network_error{Result{CURLE_UNSUPPORTED_PROTOCOL}};
+                size_t& opened {connections[host]};
+                bool full {active[host] >= opened*max_streams};          // 已开的连接都满了
+                if (full)
+                    ++opened;
+                if (full and opened>1)
+                    curl_easy_setopt(handle, CURLOPT_FRESH_CONNECT, 1L);           // curl总是复用能多路复用的连接，只能显式要求新连接
+                else
+                    curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);          // 等待已有连接确认能否复用，而不是抢先新建连接
+            }
+            if (curl_multi_add_handle(ptr, handle) != CURLM_OK)
+                throw Network_error{};
+            ++active[host];
+            transfers.emplace(handle, std::move(transfer));
+        }
+        bool finish()          // 移除已结束的请求并调用其回调，然后启动排队中的请求。回调中可以加入新请求。返回是否有请求结束
+        {
+            bool finished {};
+            int left {};
+            while (CURLMsg* msg {curl_multi_info_read(ptr, &left)})
+                if (msg->msg == CURLMSG_DONE)
+                    finished = complete(msg->easy_handle, msg->data.result) or finished;
+            return finished;
+        }
+        bool expire()          // 调用定时已到的进度回调，中止要求中止的请求。返回是否有请求结束
+        {
+            vector<CURL*> aborted;
+            for (auto& i : transfers)
+                if (i.second->curl->call_progress())
+                    aborted.push_back(i.first);
+            bool finished {};
+            for (auto handle : aborted)
+                finished = complete(handle, CURLE_ABORTED_BY_CALLBACK) or finished;
+            return finished;
+        }
+        bool complete(CURL* handle, CURLcode code)           // 移除结束的请求并调用其回调，然后启动该主机排队中的请求。返回是否有该请求
+        {
+            curl_multi_remove_handle(ptr, handle);
+            auto node = transfers.extract(handle);
+            if (node.empty())
+                return false;
+            string host {node.mapped()->curl->host};
+            if (--active[host] == 0)
+                connections.erase(host);
+            auto queue = pending.find(host);
+            if (queue != pending.end()) {
+                unique_ptr<Transfer> next {std::move(queue->second.front())};
+                queue->second.pop_front();
+                if (queue->second.empty())
+                    pending.erase(queue);
+                start(std::move(next));
+            }
+            if (node.mapped()->done)
+                node.mapped()->done(node.mapped()->curl->result(code));
+            return true;
+        }
+        bool resume()          // 调用已就绪的等待的then，then中加入的等待留到下一轮。返回是否有等待结束
+        {
+            vector<Wait> ready;
+            for (auto i=waits.begin(); i!=waits.end(); )
+                if (i->ready()) {
+                    ready.push_back(std::move(*i));
+                    i = waits.erase(i);
+                }
+                else
+                    ++i;
+            for (auto& i : ready)
+                i.then();
+            return not ready.empty();
+        }
+        bool perform_local()           // 阻塞执行此前加入的非Curl请求并调用其回调，回调中加入的请求留到下一轮。返回是否有请求结束
+        {
+            deque<unique_ptr<Transfer>> ready;
+            ready.swap(local);
+            for (auto& transfer : ready) {
+                Result result {transfer->transport->perform()};
+                if (transfer->done)
+                    transfer->done(result);
+            }
+            return not ready.empty();
+        }
     };
     
 }
@@ -14,13 +14,31 @@ namespace LLM {        // 该名字空间负责封装一些常用的大模型接
             void set_system(string&& system);          // 设置系统提示词
             virtual void get(string&& question);             // 调用大模型
             void get(const string& question) { get(string{question}); }
+            virtual void get(Curl::Multi& multi, string&& question, Done_func done ={});           // 异步调用大模型：把调用加入multi后立即返回，由multi.run()驱动，结束后记录历史并调用done(出错时的异常)
             void add_history(string&& ques, string&& ans);       // 设置历史记录，可以用于训练模型
             const string& get_history(string_view ques ="") const;       // 获取历史记录中某问题的答案，若参数为空字符串则最近一次问题的答案，若未找到则抛出Not_found_error，若历史记录为空则抛出Empty_history_error
             complex<string> get_history(int index) const;          // 获取第index次对话的历史记录，若未找到则抛出Not_found_error，若历史记录为空则抛出Empty_history_error
             void clear_history();          // 清空历史记录
+            const string& get_finish_reason() const;           // 上一次调用的结束原因(stop/length/content_filter/tool_calls等)，收到后立即交出剩余的token，最多再等100毫秒服务器结束响应
+            const Usage& get_usage() const;          // 上一次调用的token用量：输入、输出、其中的深度思考、命中与未命中上下文缓存的token数。模型调用工具时是各轮请求之和
+            void set_samples(size_t n, Sample_sink sink ={});            // 每次调用生成n个样本：第0个样本照常交给回调函数并记入历史，其余样本的token交给sink(index, token, reasoning)，不参与合并
+            const vector<Sample>& get_samples() const;           // 上一次调用的全部样本(答案、深度思考、结束原因)，只生成一个样本时为空
+            virtual void choose_sample(size_t index);            // 改用上一次调用的第index个样本作为历史记录中的答案，若没有该样本则抛出Not_found_error
+            void add_tool(string&& name, string&& description, string&& parameters, Tool_handler handler);           // 注册工具(函数)，parameters是参数的JSON Schema。模型流式给出的某个调用一完整，handler就在工作线程中开始执行，全部结果齐全后自动发出后续请求
+            void clear_tools();          // 清空注册的工具
+            void set_tool_rounds(size_t rounds);             // 一次调用中最多自动发出几轮后续请求(默认8)，超过时抛出LLM_error
+            const vector<Tool_call>& get_tool_calls() const;             // 上一次调用中完成的全部工具调用及结果
             void set_temperature(double temp);       // 温度
             void set_model(string&& m);    // 有些品牌有多个子模型，在这里设置
-            void set(string&& property, string&& value, bool quote_value =false);          // 设定模型的某个调用参数，如果quote_value为true，就用引号括住value。
+            void set(string&& property, string&& value, bool quote_value =false);          // 设定模型的某个调用参数，如果quote_value为true，就用引号括住value。property为"unix_socket"时改经该Unix域套接字连接，所用的libcurl须启用Unix域套接字(随附的Windows版libcurl 7.64.1未启用，需替换)，否则调用时抛出Network_error
+            void set_retry(Curl::Retry_policy policy);         // 设置失败重试策略(限流、服务器繁忙、连接中断等)，只有尚未收到任何token时才会重试
+            void set_cancel_token(const Cancel_token& token);         // 设置取消标志。回调函数也可以返回bool，返回false同样中止生成
+            void set_coalescing(const Coalescing& policy);           // 设置合并token的策略：攒够若干字节或等待一段时间(如16ms)后再一起交给回调函数，生成结束和深度思考与答案切换时也会交出
+            void set_deadlines(const Deadlines& limits);         // 设置连接、首token、token间隔和总时长的期限，超过时中止调用并抛出Timeout_error
+            void set_stream_upload(bool stream);           // 设置是否流式上传请求体，长对话可减少内存占用并提早发出首字节
+            bool warmup(bool background =false);           // 提前建立到服务器的连接，首次阻塞调用不再等待握手，Multi中的调用用不上它。background为true时在后台进行。应在设置好传输方式、url与Unix域套接字之后调用
+            static void set_auto_warmup(bool warm);          // 设置之后创建的对象是否自动于后台预热连接：在首次设置传输方式、url、Unix域套接字或期限时开始，都没有设置时在首次阻塞调用时开始。只预热一次，应先设置传输方式与Unix域套接字
+            void set_transport(Curl::Transport::Factory factory);          // 设置传输方式，为空时经网络传输。Curl::Mock::factory(Curl::Script)在进程内回放脚本化的SSE响应，用于测试和剖析
             static string encode(int from, int to, const char* source);        // 将source从from编码转为to编码。source不能为空指针
             string encode(const char* source) const;             // 将代码编码转为程序编码，等价于encode(code_encode, prog_encode, source)
         protected:private:
@@ -30,7 +48,9 @@ namespace LLM {        // 该名字空间负责封装一些常用的大模型接
         // 所有深度思考模型都提供的接口：
         class Reasoner : public LLM {
         public:
-            const string& remem_reasoning() const;       // 获取上一次深度思考的内容
+            const string& remem_reasoning() const;       // 获取上一次深度思考的内容，按保留策略可能为空、只有结尾，或在首次获取时从文件读回
+            void set_reasoning_policy(const Reasoning_policy& policy);           // 设置深度思考的保留策略：全部保留、交给回调后丢弃、只留最后tail_bytes字节，或追加写入spill_file
+            const Reasoning_handle& reasoning_handle() const;            // 上一次写入文件的深度思考的文件名、偏移和长度
             // 继承了LLM的所有public接口
         protected:private:
             // 省略
@@ -47,48 +67,61 @@ namespace LLM {        // 该名字空间负责封装一些常用的大模型接
     using LLM_impl::File_format_error;           // 文件格式错误，比如user后不是assistant，或assistant前不是user
     using LLM_impl::Empty_history_error;         // 在空历史记录中寻找历史记录的异常
     using LLM_impl::LLM_error;                   // 生成出错
+    using LLM_impl::Timeout_error;               // 超过期限，调用被中止
+    using LLM_impl::Cancel_token;                // 取消标志：在任意线程中触发即可中止正在进行的生成，已生成的部分记入历史，之后的调用不受影响
+    using LLM_impl::Hedge;                       // 对冲调用：主模型首token迟迟不来时向备用模型发出同样的调用，先出token者胜出
+    using LLM_impl::Usage;                       // 一次调用的token用量，由get_usage()取得
+    using LLM_impl::Sample;                      // 多样本调用中的一个样本，由get_samples()取得
+    using LLM_impl::Tool_call;                   // 模型发起的一次工具调用及其结果，由get_tool_calls()取得
+    using LLM_impl::Reasoning_policy;            // 深度思考的保留策略，交给Reasoner::set_reasoning_policy
     using namespace LLM_impl;
     
     // R1类是DeepSeek的推理模型，以综合能力强大著称
     // 费用：输入4，输出16，单位元/百万tokens
     class R1 : public Reasoner {
     public:
-        R1(string&& key, function<void(string&&, bool)> func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Reasoner{"https://api.deepseek.com/v1/chat/completions","deepseek-reasoner",std::move(key),func,code_encode,prog_encode} { }
+        template<typename F>
+        R1(string&& key, F func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Reasoner{"https://api.deepseek.com/v1/chat/completions","deepseek-reasoner",std::move(key),std::move(func),code_encode,prog_encode} { }
     };
     
     // V3类是DeepSeek的文本模型
     // 费用：R1的一半
     class V3 : public Chat {
     public:
-        V3(string&& key, function<void(string&&)> func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Chat{"https://api.deepseek.com/v1/chat/completions","deepseek-chat",std::move(key),func,code_encode,prog_encode} { }
+        template<typename F>
+        V3(string&& key, F func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Chat{"https://api.deepseek.com/v1/chat/completions","deepseek-chat",std::move(key),std::move(func),code_encode,prog_encode} { }
     };
     
     // Zhipu类是智谱清言的免费模型，是目前唯一免费调用API的模型
     // 费用：0
     class Zhipu : public Chat {
     public:
-        Zhipu(string&& key, function<void(string&&)> func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Chat{"https://open.bigmodel.cn/api/paas/v4/chat/completions","glm-4-flash",std::move(key),func,code_encode,prog_encode} { }
+        template<typename F>
+        Zhipu(string&& key, F func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Chat{"https://open.bigmodel.cn/api/paas/v4/chat/completions","glm-4-flash",std::move(key),std::move(func),code_encode,prog_encode} { }
     };
     
     // Qwen类是通义千问的QwQ-32B模型，是价格较为实惠的推理模型
     // 费用：输入2，输出6，单位元/百万tokens
     class Qwen : public Reasoner {
     public:
-        Qwen(string&& key, function<void(string&&, bool)> func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Reasoner{"https://dashscope.aliyuncs.com/compatible-mode/v1/chat/completions","qwq-32b",std::move(key),func,code_encode,prog_encode} { }
+        template<typename F>
+        Qwen(string&& key, F func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Reasoner{"https://dashscope.aliyuncs.com/compatible-mode/v1/chat/completions","qwq-32b",std::move(key),std::move(func),code_encode,prog_encode} { }
     };
     
     // Doubao类是豆包的角色扮演模型，拥有不错的角色扮演能力
     // 费用：输入0.4，输出1，单位元/百万tokens
     class Doubao : public Chat {
     public:
-        Doubao(string&& key, function<void(string&&)> func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Chat{"https://ark.cn-beijing.volces.com/api/v3/chat/completions","doubao-1-5-pro-32k-character-250228",std::move(key),func,code_encode,prog_encode} { }
+        template<typename F>
+        Doubao(string&& key, F func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Chat{"https://ark.cn-beijing.volces.com/api/v3/chat/completions","doubao-1-5-pro-32k-character-250228",std::move(key),std::move(func),code_encode,prog_encode} { }
     };
     
     // Polite类是DeepSeek-V3的实例化，是非常有素质的AI
     // 费用：同V3
     class Polite : public V3 {
     public:
-        Polite(string&& key, function<void(string&&)> func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : V3{std::move(key),func,code_encode,prog_encode} { self_cultivation(); }
+        template<typename F>
+        Polite(string&& key, F func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : V3{std::move(key),std::move(func),code_encode,prog_encode} { self_cultivation(); }
         void get(string_view question, int length);       // 调用大模型
         void get(string&& question) override { get(question, 1300); }
         using V3::get;
@@ -100,7 +133,8 @@ namespace LLM {        // 该名字空间负责封装一些常用的大模型接
     // 费用：同V3
     class Fim : public Fim_base {
     public:
-        Fim(string&& key, function<void(string&&)> func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Fim_base{std::move(key),func,code_encode,prog_encode} { };
+        template<typename F>
+        Fim(string&& key, F func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Fim_base{std::move(key),std::move(func),code_encode,prog_encode} { };
         void set_prefix(string&& prefix) { set("prompt", std::move(prefix), true); }
         void set_suffix(string&& suffix) { set("suffix", std::move(suffix), true); }
         void get() { Fim_base::get({}); }
@@ -84,10 +84,18 @@ namespace LLM_impl {
             temperature = std::stod(value);
         else if (property == "model")
             model = std::move(value);
-        else if (property == "url")
+        else if (property == "url") {
             url = std::move(value);
-        else if (property == "key")
+            auto_warmup();
+        }
+        else if (property == "unix_socket") {
+            unix_socket = std::move(value);
+            auto_warmup();
+        }
+        else if (property == "key") {
             key = std::move(value);
+            make_headers();
+        }
         else if (property == "stream") {
             if (value != "true")
                 throw LLM_error{"目前暂不支持非流式调用"};
@@ -106,27 +114,218 @@ namespace LLM_impl {
         }
     }
     
-    string LLM::request_body(string_view question) const
+    string LLM::request_body(string_view question, string_view exchange) const
+    {
+        string body;
+        string segment;
+        for (size_t i {}; body_segment(i, question, exchange, history.size(), segment); ++i)
+            body.append(segment);
+        return body;
+    }
+    
+    Curl::Transport::Read_func LLM::body_source(string_view question, string_view exchange) const
     {
-        ostringstream ostr;
-        ostr << '{';
-        ostr << R"("model": ")" << model << R"(",)";
-        if (temperature>=0 and temperature<=2)
-            ostr << R"("temperature": )" << temperature << ',';
-        for (auto i=settings.begin(); i!=settings.end(); ++i) {
-            ostr << '"' << *i << R"(": )";
-            ostr << *++i << ',';
+        size_t messages {history.size()};
+        return [this, question, exchange, messages, index=size_t{}, segment=string{}, offset=size_t{}](char* buffer, size_t size) mutable -> size_t {
+            while (offset == segment.length()) {
+                if (not body_segment(index++, question, exchange, messages, segment))
+                    return 0;
+                offset = 0;
+            }
+            size_t length {std::min(size, segment.length()-offset)};
+            segment.copy(buffer, length, offset);
+            offset += length;
+            return length;
+        };
+    }
+    
+    bool LLM::body_segment(size_t index, string_view question, string_view exchange, size_t messages, string& segment) const
+    {
+        segment.clear();
+        if (index == 0) {
+            ostringstream ostr;
+            ostr << '{';
+            ostr << R"("model": ")" << model << R"(",)";
+            if (temperature>=0 and temperature<=2)
+                ostr << R"("temperature": )" << temperature << ',';
+            for (auto i=settings.begin(); i!=settings.end(); ++i) {
+                ostr << '"' << *i << R"(": )";
+                ostr << *++i << ',';
+            }
+            ostr << R"("stream": true,)";
+            if (requests_usage())          // 请求在最后附上本次调用的用量
+                ostr << R"("stream_options": {"include_usage": true},)";
+            if (not tools.empty()) {
+                ostr << R"("tools": [)";
+                for (auto i=tools.begin(); i!=tools.end(); ++i) {
+                    if (i != tools.begin())
+                        ostr << ',';
+                    ostr << R"({"type": "function", "function": {"name": ")" << escape(i->name) << R"(", "description": ")" << escape(i->description) << R"(", "parameters": )";
+                    ostr << ((i->parameters.empty()) ? R"({"type": "object", "properties": {}})" : i->parameters) << "}}";
+                }
+                ostr << "],";
+            }
+            ostr << R"("messages": [)";
+            segment = encode(prog_encode, CP_UTF8, ostr.str().c_str());
         }
-        ostr << R"("stream": true,)";
-        ostr << R"("messages": [)";
-        if (not sys.empty())
-            ostr << R"({"role": "system", "content": ")" << escape(sys) << R"("},)";
-        for (auto i=history.begin(); i!=history.end(); ++i) {
-            ostr << R"({"role": "user", "content": ")" << escape(*i) << R"("},)";
-            ostr << R"({"role": "assistant", "content": ")" << escape(*++i) << R"("},)";
+        else if (index == 1) {
+            if (not sys.empty())
+                segment = message("system", sys.c_str())+',';
+        }
+        else if (index-2 < messages)
+            segment = message((index%2 == 0) ? "user" : "assistant", history[index-2].c_str())+',';
+        else if (index-2 == messages)
+            segment = message("user", string{question}.c_str())+string{exchange}+"]}";
+        else
+            return false;
+        return true;
+    }
+    
+    void LLM::follow_up(Message_func& mfunc) const
+    {
+        auto& runs = mfunc.tool_runs();
+        start_tools(mfunc, runs.size());             // 没有收到结束原因时，最后一个调用尚未启动
+        string& exchange {mfunc.tool_exchange()};
+        string_view content {mfunc.round_answer()};
+        exchange.append(R"(,{"role": "assistant", "content": )");
+        if (content.empty())
+            exchange.append("null");
+        else {
+            exchange.push_back('"');
+            exchange.append(escape(encode(prog_encode, CP_UTF8, string{content}.c_str())));
+            exchange.push_back('"');
+        }
+        exchange.append(R"(, "tool_calls": [)");
+        for (auto i=runs.begin(); i!=runs.end(); ++i) {
+            if (i != runs.begin())
+                exchange.push_back(',');
+            exchange.append(R"({"id": ")"+escape(encode(prog_encode, CP_UTF8, i->call.id.c_str())));
+            exchange.append(R"(", "type": "function", "function": {"name": ")"+escape(encode(prog_encode, CP_UTF8, i->call.name.c_str())));
+            exchange.append(R"(", "arguments": ")"+escape(encode(prog_encode, CP_UTF8, i->call.arguments.c_str()))+R"("}})");
+        }
+        exchange.append("]}");
+        for (auto& i : runs) {           // 按调用顺序等待结果，先完成的调用早已在后台执行完毕
+            i.call.result = i.result.get();
+            exchange.append(R"(,{"role": "tool", "tool_call_id": ")"+escape(encode(prog_encode, CP_UTF8, i.call.id.c_str())));
+            exchange.append(R"(", "content": ")"+escape(encode(prog_encode, CP_UTF8, i.call.result.c_str()))+R"("})");
+            mfunc.add_tool_call(std::move(i.call));
         }
-        ostr << R"({"role": "user", "content": ")" << escape(question) << R"("})";
-        ostr << "]}";
-        return ostr.str();
+        runs.clear();
+    }
+    
+    string LLM::message(string_view role, const char* content) const
+    {
+        string msg {R"({"role": ")"};
+        msg.append(role);
+        msg.append(R"(", "content": ")");
+        msg.append(escape(encode(prog_encode, CP_UTF8, content)));
+        msg.append(R"("})");
+        return msg;
+    }
+    
+    void Hedge::get(string&& question)
+    {
+        enum class Side { none, primary, secondary };
+        Side winner {Side::none};
+        bool hedged {};
+        bool primary_done {};
+        bool secondary_done {};
+        bool finished {};
+        exception_ptr primary_error;
+        exception_ptr error;
+        auto start = steady_clock::now();
+        auto elapsed = [&start] { return std::chrono::duration_cast<milliseconds>(steady_clock::now()-start); };
+        struct Gate_guard {          // 无论如何结束都要撤下两个模型的首token检查
+            LLM& primary;
+            LLM& secondary;
+            ~Gate_guard()
+            {
+                primary.gate = nullptr;
+                secondary.gate = nullptr;
+            }
+        } guard {primary,secondary};
+        primary.gate = [&] {
+            if (winner == Side::none) {
+                winner = Side::primary;
+                record(elapsed());
+            }
+            return winner == Side::primary;
+        };
+        secondary.gate = [&] {
+            if (winner == Side::none) {
+                winner = Side::secondary;
+                record(elapsed());           // 主模型的首token耗时至少是这么久
+            }
+            return winner == Side::secondary;
+        };
+        Curl::Multi multi;           // 最后定义，先于上面的状态析构，未结束的一方随之被取消
+        auto hedge = [&] {
+            hedged = true;
+            secondary.get(multi, string{question}, [&](exception_ptr e) {
+                secondary_done = true;
+                if (winner == Side::secondary) {
+                    finished = true;
+                    error = e;
+                }
+                else if (winner==Side::none and primary_done) {          // 双方都没有出token就结束了
+                    finished = true;
+                    error = (primary_error) ? primary_error : e;
+                }
+            });
+        };
+        primary.get(multi, string{question}, [&](exception_ptr e) {
+            primary_done = true;
+            primary_error = e;
+            if (winner==Side::none and not e)          // 没有任何token的正常结束
+                winner = Side::primary;
+            if (winner == Side::primary) {
+                finished = true;
+                error = e;
+            }
+            else if (winner == Side::none) {
+                if (not hedged)          // 主模型出token前就失败了，立即转向备用模型
+                    hedge();
+                else if (secondary_done) {
+                    finished = true;
+                    error = e;
+                }
+            }
+        });
+        while (not finished) {
+            int timeout_ms {1000};
+            if (not hedged and winner==Side::none) {
+                milliseconds left {delay()-elapsed()};
+                if (left.count() <= 0) {
+                    hedge();
+                    continue;
+                }
+                timeout_ms = static_cast<int>(std::min<long long>(timeout_ms, left.count()+1));
+            }
+            if (not multi.run_once(timeout_ms) and not finished)
+                throw LLM_error{"对冲调用意外结束"};
+        }
+        if (error)
+            std::rethrow_exception(error);
+        LLM& won {(winner == Side::secondary) ? secondary : primary};
+        LLM& lost {(winner == Side::secondary) ? primary : secondary};
+        last_winner = &won;
+        lost.add_history(std::move(question), string{won.get_history()});
+    }
+    
+    milliseconds Hedge::delay() const
+    {
+        if (samples.size() < min_samples)
+            return initial_delay;
+        vector<milliseconds> sorted {samples.begin(), samples.end()};
+        size_t index {std::min(sorted.size()-1, static_cast<size_t>(percentile*sorted.size()))};
+        std::nth_element(sorted.begin(), sorted.begin()+index, sorted.end());
+        return sorted[index];
+    }
+    
+    void Hedge::record(milliseconds latency)
+    {
+        samples.push_back(latency);
+        if (samples.size() > max_samples)
+            samples.pop_front();
     }
 }
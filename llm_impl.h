@@ -10,11 +10,28 @@
 #include <fstream>
 #include <complex>
 #include <functional>
+#include <exception>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <type_traits>
+#include <cstring>
+#include <cstdlib>
 
 #include <winsock2.h>
 #include <windows.h>
 #include "curl.hpp"
 
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+#define LLM_SIMD_SCAN             // 编译器支持按函数选择指令集，运行时按CPU选用向量化的扫描
+#include <immintrin.h>
+#endif
+
 namespace LLM_impl {             // 该名字空间负责实现大模型的基类
     
     using std::string;
@@ -22,17 +39,233 @@ namespace LLM_impl {             // 该名字空间负责实现大模型的基
     using std::string_view;
     using std::ostringstream;
     using std::shared_ptr;
-    using std::istringstream;
+    using std::unique_ptr;
     using std::ifstream;
     using std::ofstream;
     using std::complex;
     using std::function;
+    using std::exception_ptr;
+    using std::make_shared;
+    using std::shared_future;
+    using std::chrono::steady_clock;
+    using std::chrono::milliseconds;
+    using std::deque;
+    using std::future;
+    using std::mutex;
     
     enum class Mode { system, user, assistant, none };       // 文件内容分区
     
     struct Not_found_error {};       // 未找到
     struct File_format_error {};             // 文件格式错误，比如user后不是assistant，或assistant前不是user
     struct Empty_history_error {};       // 在空历史记录中寻找历史记录的异常
+    struct Json_error {};            // json格式错误
+    
+    enum class Deadline { connect, first_token, token_gap, total };        // 调用的各项期限
+    
+    struct Timeout_error {           // 超过期限，调用被中止
+        Deadline deadline;
+    };
+    
+    class Cancel_token {             // Cancel_token类是可在任意线程中触发的取消标志，复制品共享同一个标志。每次调用开始时记下它的状态，只有此后的触发才中止该调用，不必重置
+    public:
+        Cancel_token() : count{make_shared<std::atomic<unsigned long>>(0)} { }
+        void cancel() { ++*count; }          // 中止正在进行的调用，已生成的部分照常记入历史。没有进行中的调用时不起作用
+        unsigned long state() const { return *count; }
+        bool cancelled(unsigned long since) const { return *count != since; }          // 记下状态since之后是否被触发过
+    private:
+        shared_ptr<std::atomic<unsigned long>> count;            // 触发的次数
+    };
+    
+    template<typename F, typename... Args>
+    bool call_sink(F& func, Args&&... args)          // 调用返回void或bool的回调函数，返回是否继续生成
+    {
+        if constexpr (std::is_void_v<std::invoke_result_t<F&, Args...>>) {
+            func(std::forward<Args>(args)...);
+            return true;
+        }
+        else
+            return func(std::forward<Args>(args)...);
+    }
+    
+    template<typename... Args>
+    class Sink {           // Sink类是用户回调函数的类型擦除包装，供不能成为模板的接口保存回调。回调函数可以返回void，也可以返回bool，返回false表示中止本次生成
+    public:
+        Sink() = default;            // 空回调，只能检查不能调用
+        template<typename F, typename =std::enable_if_t<std::is_invocable_v<F&, Args...> and not std::is_same_v<std::decay_t<F>, Sink>>>
+        Sink(F f)            // 按返回类型存入对应的function，每次调用只经过一层类型擦除
+        {
+            if constexpr (std::is_void_v<std::invoke_result_t<F&, Args...>>)
+                proc = std::move(f);
+            else
+                func = std::move(f);
+        }
+        bool operator()(Args... args) const          // 调用回调函数，返回是否继续生成
+        {
+            if (proc) {
+                proc(std::forward<Args>(args)...);
+                return true;
+            }
+            return func(std::forward<Args>(args)...);
+        }
+        explicit operator bool() const { return proc or func; }
+    private:
+        function<void(Args...)> proc;            // 返回void的回调
+        function<bool(Args...)> func;            // 返回bool的回调
+    };
+    
+    using Chat_sink = Sink<string&&>;            // 通用模型的回调函数：void或bool(string&& token)
+    using Reason_sink = Sink<string&&, bool>;          // 深度思考模型的回调函数：void或bool(string&& token, bool reasoning)
+    using Sample_sink = Sink<size_t, string&&, bool>;            // 多样本调用中其余样本的回调函数：void或bool(size_t index, string&& token, bool reasoning)
+    
+    struct Sample {          // 一次调用生成多个样本(n>1)时的一个样本
+        string answer;
+        string reasoning;
+        string finish_reason;
+    };
+    
+    using Tool_handler = function<string(const string& arguments)>;          // 工具的实现：参数是模型给出的json参数，返回交给模型的结果，都是程序编码。在Tool_pool的工作线程中执行，可能与其他工具及生成同时进行
+    
+    class Tool_pool {            // Tool_pool类是执行工具调用的固定数量的工作线程，线程数不随调用增加，超出的调用排队等待
+    public:
+        explicit Tool_pool(size_t threads)
+        {
+            for (size_t i {}; i<threads; ++i)
+                workers.emplace_back([this] { work(); });
+        }
+        Tool_pool(const Tool_pool&) =delete;
+        Tool_pool& operator=(const Tool_pool&) =delete;
+        future<string> submit(function<string()> task)           // 提交一次调用，结果或异常在返回的future中
+        {
+            std::packaged_task<string()> packaged {std::move(task)};
+            future<string> result {packaged.get_future()};
+            {
+                std::lock_guard<mutex> lock {m};
+                tasks.push_back(std::move(packaged));
+            }
+            ready.notify_one();
+            return result;
+        }
+        static Tool_pool& shared()           // 各模型共用的线程池，线程数为CPU核数，至少4个
+        {
+            static Tool_pool pool {std::max<size_t>(4, std::thread::hardware_concurrency())};
+            return pool;
+        }
+        ~Tool_pool()             // 执行完排队中的调用后结束各线程
+        {
+            {
+                std::lock_guard<mutex> lock {m};
+                stopping = true;
+            }
+            ready.notify_all();
+            for (auto& i : workers)
+                i.join();
+        }
+    private:
+        mutex m;
+        std::condition_variable ready;
+        deque<std::packaged_task<string()>> tasks;
+        vector<std::thread> workers;
+        bool stopping {};
+        void work()
+        {
+            for (;;) {
+                std::packaged_task<string()> task;
+                {
+                    std::unique_lock<mutex> lock {m};
+                    ready.wait(lock, [this] { return stopping or not tasks.empty(); });
+                    if (tasks.empty())
+                        return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+    };
+    
+    struct Tool {            // 注册给模型的一个工具(函数)
+        string name;
+        string description;
+        string parameters;           // 参数的JSON Schema，原样放入请求体，为空时表示没有参数
+        Tool_handler handler;
+    };
+    
+    struct Tool_call {           // 模型发起的一次工具调用，都是程序编码
+        string id;
+        string name;
+        string arguments;            // json参数
+        string result;           // 工具返回的结果
+    };
+    
+    struct Deadlines {           // 调用的期限，为0表示不限。连接期限由curl检查，其余期限由执行请求的事件循环按时检查
+        milliseconds connect {};             // 建立连接
+        milliseconds first_token {};         // 从发出请求到收到第一个token
+        milliseconds token_gap {};           // 相邻两个token的最长间隔
+        milliseconds total {};           // 整个调用
+    };
+    
+    struct Usage {           // 一次调用的token用量，服务器没有报告时全为0
+        long long prompt_tokens {};          // 输入
+        long long completion_tokens {};          // 输出，包括深度思考
+        long long reasoning_tokens {};           // 输出中深度思考的部分
+        long long cache_hit_tokens {};           // 输入中命中上下文缓存的部分
+        long long cache_miss_tokens {};          // 输入中未命中上下文缓存的部分
+        long long total_tokens {};
+        bool reported {};            // 服务器是否报告了用量
+        Usage& operator+=(const Usage& other)            // 累加另一次请求的用量
+        {
+            prompt_tokens += other.prompt_tokens;
+            completion_tokens += other.completion_tokens;
+            reasoning_tokens += other.reasoning_tokens;
+            cache_hit_tokens += other.cache_hit_tokens;
+            cache_miss_tokens += other.cache_miss_tokens;
+            total_tokens += other.total_tokens;
+            reported = reported or other.reported;
+            return *this;
+        }
+    };
+    
+    struct Tool_fragment {             // 一次工具调用在一个事件中的增量(UTF-8)
+        size_t index {};             // 调用的序号，同一调用的参数分散在多个事件中
+        string id;
+        string name;
+        string arguments;
+    };
+    
+    struct Choice {            // 一个样本在一个事件中的增量(UTF-8)
+        size_t index {};             // 样本序号，n>1时各样本的事件交错到达
+        string content;          // 答案，补全接口中为text
+        string reasoning;            // 深度思考
+        vector<Tool_fragment> tools;             // 只有前tool_count项有效
+        size_t tool_count {};
+        string finish_reason;
+    };
+    
+    struct Delta {             // 流式响应中一个事件携带的增量
+        vector<Choice> choices;          // 只有前count项有效，各项的缓冲在事件之间复用
+        size_t count {};
+        Usage usage;             // 通常只有最后一个事件报告用量
+        bool done {};            // 是否是[DONE]
+    };
+    
+    struct Coalescing {          // 合并token的策略：缓冲的token攒够bytes字节，或其中最早的token已等待window时，一起交给回调函数。都为0表示不合并
+        size_t bytes {};
+        milliseconds window {};
+    };
+    
+    enum class Retention { keep, discard, tail, spill };           // 深度思考的保留方式：全部保留、交给回调后丢弃、只留最后若干字节、追加写入文件
+    
+    struct Reasoning_policy {            // 深度思考的保留策略
+        Retention retention {Retention::keep};
+        size_t tail_bytes {};            // tail时保留的字节数，截断处不会切开字符
+        string spill_file;           // spill时追加写入的文件，不要与其他对象同时写同一个文件
+    };
+    
+    struct Reasoning_handle {            // 写入文件的一段深度思考(程序编码)
+        string file;             // 为空表示没有写入文件
+        long long offset {};
+        size_t length {};
+    };
     
     class LLM_error {          // 生成出错
     public:
@@ -42,54 +275,837 @@ namespace LLM_impl {             // 该名字空间负责实现大模型的基
         string message;
     };
     
+    class Scanner {          // Scanner类在字节串中查找字符，运行时按CPU选用AVX2(每次32字节)、SSE4.2(每次16字节)或逐字节的实现
+    public:
+        enum class Path { scalar, sse42, avx2 };             // 各实现
+        static size_t find(string_view text, string_view set, size_t pos =0)           // 从pos起查找set中任一字符的位置，未找到时返回string_view::npos。set为1至16个字符
+        {
+            if (pos >= text.length())
+                return string_view::npos;
+            return selected()(text.data(), text.length(), set.data(), set.length(), pos);
+        }
+        static bool use(Path path)           // 改用指定的实现，CPU或编译器不支持时返回false且不做改动。用于基准测试比较各实现，应在开始解析之前调用
+        {
+            switch (path) {
+            case Path::scalar:
+                selected() = scalar;
+                return true;
+#ifdef LLM_SIMD_SCAN
+            case Path::sse42:
+                __builtin_cpu_init();
+                if (not __builtin_cpu_supports("sse4.2"))
+                    return false;
+                selected() = sse42;
+                return true;
+            case Path::avx2:
+                __builtin_cpu_init();
+                if (not __builtin_cpu_supports("avx2"))
+                    return false;
+                selected() = avx2;
+                return true;
+#endif
+            default:
+                return false;
+            }
+        }
+    private:
+        using Find_func = size_t(*)(const char*, size_t, const char*, size_t, size_t);
+        static Find_func& selected()
+        {
+            static Find_func func {select()};
+            return func;
+        }
+        static Find_func select()
+        {
+#ifdef LLM_SIMD_SCAN
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2"))
+                return avx2;
+            if (__builtin_cpu_supports("sse4.2"))
+                return sse42;
+#endif
+            return scalar;
+        }
+        static size_t scalar(const char* text, size_t length, const char* set, size_t count, size_t pos)
+        {
+            if (count == 1) {
+                auto found = static_cast<const char*>(std::memchr(text+pos, set[0], length-pos));
+                return (found) ? found-text : string_view::npos;
+            }
+            for (; pos<length; ++pos)
+                if (std::memchr(set, text[pos], count))
+                    return pos;
+            return string_view::npos;
+        }
+#ifdef LLM_SIMD_SCAN
+        __attribute__((target("sse4.2")))
+        static size_t sse42(const char* text, size_t length, const char* set, size_t count, size_t pos)
+        {
+            char chars[16] {};
+            std::copy(set, set+count, chars);
+            __m128i needle {_mm_loadu_si128(reinterpret_cast<const __m128i*>(chars))};
+            for (; pos+16<=length; pos+=16) {
+                __m128i block {_mm_loadu_si128(reinterpret_cast<const __m128i*>(text+pos))};
+                int index {_mm_cmpestri(needle, static_cast<int>(count), block, 16, _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY|_SIDD_LEAST_SIGNIFICANT)};
+                if (index < 16)
+                    return pos+index;
+            }
+            return scalar(text, length, set, count, pos);          // 不足16字节的结尾
+        }
+        __attribute__((target("avx2")))
+        static size_t avx2(const char* text, size_t length, const char* set, size_t count, size_t pos)
+        {
+            __m256i needles[16];
+            for (size_t i {}; i<count; ++i)
+                needles[i] = _mm256_set1_epi8(set[i]);
+            for (; pos+32<=length; pos+=32) {
+                __m256i block {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(text+pos))};
+                __m256i hit {_mm256_cmpeq_epi8(block, needles[0])};
+                for (size_t i {1}; i<count; ++i)
+                    hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(block, needles[i]));
+                unsigned mask {static_cast<unsigned>(_mm256_movemask_epi8(hit))};
+                if (mask)
+                    return pos+__builtin_ctz(mask);
+            }
+            return scalar(text, length, set, count, pos);          // 不足32字节的结尾
+        }
+#endif
+    };
+    
+    class Sse_framer {         // Sse_framer类从任意切分的响应数据中逐个取出事件的数据，跨越两次写入的行先攒在缓冲区中
+    public:
+        void feed(string_view data) { chunk = data; }          // 交给一次写入的数据，它须存活到next返回false
+        bool next(string_view& event)          // 取出下一个data行的内容，返回false表示需要更多数据。event在下一次调用next前有效。非SSE的行(如出错时多行的json)攒在一起，响应结束后由body取出
+        {
+            clear_carried();
+            while (true) {
+                auto end = Scanner::find(chunk, "\n");
+                if (end == string_view::npos) {
+                    buffer.append(chunk);
+                    chunk = {};
+                    return false;
+                }
+                string_view line {chunk.substr(0, end)};
+                chunk.remove_prefix(end+1);
+                if (not buffer.empty()) {            // 该行的开头在之前的写入中
+                    buffer.append(line);
+                    line = buffer;
+                    carried = true;
+                }
+                if (not line.empty() and line.back()=='\r')
+                    line.remove_suffix(1);
+                if (field(line, event))
+                    return true;
+                clear_carried();
+            }
+        }
+        bool pending() const { return not buffer.empty() and not carried; }          // 是否有尚未以换行结束的行
+        const string& body() const { return other; }             // 响应中所有非SSE的行，以换行连接
+        void reset()
+        {
+            chunk = {};
+            buffer.clear();
+            carried = false;
+            other.clear();
+        }
+    private:
+        string_view chunk;           // 本次写入中尚未处理的部分
+        string buffer;           // 不完整的行，复用其内存
+        bool carried {};             // 上一次交出的行在buffer中，下一次调用next时清空
+        string other;            // 非SSE的行
+        void clear_carried()
+        {
+            if (carried) {
+                buffer.clear();
+                carried = false;
+            }
+        }
+        bool field(string_view line, string_view& event)          // 解析一行，返回是否需要交给调用者
+        {
+            constexpr string_view data {"data:"};
+            if (line.empty() or line.front()==':')           // 事件之间的空行或注释(如保活)
+                return false;
+            if (line.substr(0, data.length()) == data) {
+                line.remove_prefix(data.length());
+                if (not line.empty() and line.front()==' ')
+                    line.remove_prefix(1);
+                event = line;
+                return true;
+            }
+            for (string_view name : {"event:", "id:", "retry:"})
+                if (line.substr(0, name.length()) == name)
+                    return false;
+            if (not other.empty())           // 不是SSE格式的响应，如出错时的json，可能跨越多行
+                other += '\n';
+            other.append(line);
+            return false;
+        }
+    };
+    
+    class Json_reader {            // Json_reader类按顺序读取一段json而不建立整棵树，字符串在一趟中解码到调用者的缓冲区。格式错误时抛出Json_error
+    public:
+        explicit Json_reader(string_view json) : json{json} { }
+        char peek()          // 跳过空白，返回下一个字符，已到结尾时返回'\0'
+        {
+            while (pos<json.length() and (json[pos]==' ' or json[pos]=='\t' or json[pos]=='\n' or json[pos]=='\r'))
+                ++pos;
+            return (pos<json.length()) ? json[pos] : '\0';
+        }
+        void begin_object() { begin('{'); }
+        bool next_key(string_view& key)          // 读取对象的下一个键及其后的冒号，返回false表示对象已结束。key在下一次读取前有效
+        {
+            if (not next('}'))
+                return false;
+            key = read_key();
+            expect(':');
+            return true;
+        }
+        void begin_array() { begin('['); }
+        bool next_item() { return next(']'); }           // 移到数组的下一个元素，返回false表示数组已结束
+        bool read_string(string& out)          // 若值是字符串则把解码后的内容(UTF-8)追加到out并返回true，若是null则返回false
+        {
+            if (peek() == 'n') {
+                literal("null");
+                return false;
+            }
+            expect('"');
+            while (true) {
+                auto stop = Scanner::find(json, R"("\)", pos);
+                if (stop == string_view::npos)
+                    throw Json_error{};
+                out.append(json.substr(pos, stop-pos));
+                pos = stop+1;
+                if (json[stop] == '"')
+                    return true;
+                unescape(out);
+            }
+        }
+        long long read_integer()             // 读取整数，null读作0，小数部分被舍去
+        {
+            if (peek() == 'n') {
+                literal("null");
+                return 0;
+            }
+            if (pos >= json.length())
+                throw Json_error{};
+            bool negative {json[pos] == '-'};
+            if (negative)
+                ++pos;
+            size_t start {pos};
+            long long value {};
+            for (; pos<json.length() and json[pos]>='0' and json[pos]<='9'; ++pos)
+                value = value*10+(json[pos]-'0');
+            if (pos == start)
+                throw Json_error{};
+            while (pos<json.length() and string_view{".0123456789eE+-"}.find(json[pos])!=string_view::npos)
+                ++pos;
+            return (negative) ? -value : value;
+        }
+        void skip()          // 跳过一个值
+        {
+            switch (peek()) {
+            case '{':
+                begin_object();
+                for (string_view key; next_key(key); )
+                    skip();
+                break;
+            case '[':
+                begin_array();
+                while (next_item())
+                    skip();
+                break;
+            case '"':
+                skip_string();
+                break;
+            case 't':
+                literal("true");
+                break;
+            case 'f':
+                literal("false");
+                break;
+            case 'n':
+                literal("null");
+                break;
+            default: {
+                size_t start {pos};
+                while (pos<json.length() and string_view{"+-.0123456789eE"}.find(json[pos])!=string_view::npos)
+                    ++pos;
+                if (pos == start)
+                    throw Json_error{};
+                break;
+            }
+            }
+        }
+    private:
+        string_view json;
+        size_t pos {};
+        bool first {};           // 当前对象或数组还没有读过元素，下一个元素前没有逗号
+        string buffer;           // 含转义字符的键解码后放在这里
+        void expect(char c)
+        {
+            if (peek() != c)
+                throw Json_error{};
+            ++pos;
+        }
+        void begin(char c)
+        {
+            expect(c);
+            first = true;
+        }
+        bool next(char close)          // 读到close时结束当前对象或数组，否则读取元素间的逗号
+        {
+            if (peek() == close) {
+                ++pos;
+                first = false;           // 回到外层，它至少已有这一个元素
+                return false;
+            }
+            if (not first)
+                expect(',');
+            first = false;
+            return true;
+        }
+        void literal(string_view word)
+        {
+            if (json.substr(pos, word.length()) != word)
+                throw Json_error{};
+            pos += word.length();
+        }
+        void skip_string()           // 跳过字符串，不解码
+        {
+            expect('"');
+            while (true) {
+                auto stop = Scanner::find(json, R"("\)", pos);
+                if (stop == string_view::npos)
+                    throw Json_error{};
+                pos = stop+1;
+                if (json[stop] == '"')
+                    return;
+                ++pos;
+            }
+        }
+        string_view read_key()           // 不含转义字符的键直接引用原文
+        {
+            expect('"');
+            auto stop = Scanner::find(json, R"("\)", pos);
+            if (stop == string_view::npos)
+                throw Json_error{};
+            if (json[stop] == '"') {
+                string_view key {json.substr(pos, stop-pos)};
+                pos = stop+1;
+                return key;
+            }
+            --pos;
+            buffer.clear();
+            read_string(buffer);
+            return buffer;
+        }
+        void unescape(string& out)           // 解码反斜杠之后的转义序列
+        {
+            if (pos >= json.length())
+                throw Json_error{};
+            switch (json[pos++]) {
+            case '"':
+                out.push_back('"');
+                break;
+            case '\\':
+                out.push_back('\\');
+                break;
+            case '/':
+                out.push_back('/');
+                break;
+            case 'b':
+                out.push_back('\b');
+                break;
+            case 'f':
+                out.push_back('\f');
+                break;
+            case 'n':
+                out.push_back('\n');
+                break;
+            case 'r':
+                out.push_back('\r');
+                break;
+            case 't':
+                out.push_back('\t');
+                break;
+            case 'u': {
+                unsigned code {hex4()};
+                if (code>=0xD800 and code<0xDC00 and json.substr(pos, 2)==R"(\u)") {          // 代理对
+                    pos += 2;
+                    unsigned low {hex4()};
+                    if (low>=0xDC00 and low<0xE000)
+                        code = 0x10000+((code-0xD800)<<10)+(low-0xDC00);
+                    else {
+                        append_utf8(out, 0xFFFD);
+                        code = low;
+                    }
+                }
+                if (code>=0xD800 and code<0xE000)            // 落单的代理
+                    code = 0xFFFD;
+                append_utf8(out, code);
+                break;
+            }
+            default:
+                throw Json_error{};
+            }
+        }
+        unsigned hex4()
+        {
+            if (pos+4 > json.length())
+                throw Json_error{};
+            unsigned code {};
+            for (size_t end {pos+4}; pos<end; ++pos) {
+                char c {json[pos]};
+                code <<= 4;
+                if (c>='0' and c<='9')
+                    code |= c-'0';
+                else if (c>='a' and c<='f')
+                    code |= c-'a'+10;
+                else if (c>='A' and c<='F')
+                    code |= c-'A'+10;
+                else
+                    throw Json_error{};
+            }
+            return code;
+        }
+        static void append_utf8(string& out, unsigned code)
+        {
+            if (code < 0x80)
+                out.push_back(static_cast<char>(code));
+            else if (code < 0x800) {
+                out.push_back(static_cast<char>(0xC0|code>>6));
+                out.push_back(static_cast<char>(0x80|(code&0x3F)));
+            }
+            else if (code < 0x10000) {
+                out.push_back(static_cast<char>(0xE0|code>>12));
+                out.push_back(static_cast<char>(0x80|(code>>6&0x3F)));
+                out.push_back(static_cast<char>(0x80|(code&0x3F)));
+            }
+            else {
+                out.push_back(static_cast<char>(0xF0|code>>18));
+                out.push_back(static_cast<char>(0x80|(code>>12&0x3F)));
+                out.push_back(static_cast<char>(0x80|(code>>6&0x3F)));
+                out.push_back(static_cast<char>(0x80|(code&0x3F)));
+            }
+        }
+    };
+    
     class Message_func {             // Message_func类是用户提供的回调函数和本次LLM生成的结果的绑定
     public:
         explicit Message_func(int prog_encode) : prog_encode{prog_encode} { }
-        virtual void operator()(string&& ans) = 0;       // 调用回调函数处理LLM生成的token，并记录该token。ans是流式调用中每次由LLM生成的token
         string&& get_ans() { return std::move(answer); }
         int prog_enc() const { return prog_encode; }
+        void fail(exception_ptr err) { error = err; }          // 记录回调中发生的异常。异常不能穿过curl传播，只能先记下，等请求结束后再抛出
+        exception_ptr get_error() const { return error; }
+        bool delivered() const { return has_delivered; }             // 是否已把token交给用户回调。交出后请求就不能重试，否则用户会收到重复内容
+        void set_gate(function<bool()> first_token) { gate = std::move(first_token); }         // 设置首个token到达时的检查，它返回false时丢弃该token并中止请求
+        void stop() { is_stopped = true; }         // 中止请求并丢弃结果，curl会在下一次回调时结束传输
+        void cancel() { is_cancelled = true; }         // 中止生成，已生成的部分照常作为答案
+        bool stopped() const { return is_stopped or cancelled(); }
+        bool cancelled() const { return is_cancelled or cancel_token.cancelled(cancel_since); }            // 回调要求中止，或本次调用开始后取消标志被触发
+        void expect_usage(bool expect) { usage_expected = expect; }          // 是否请求了用量，请求了就要等到用量事件才算收齐
+        void expect_samples(size_t n) { samples_expected = (n) ? n : 1; }
+        size_t samples() const { return samples_expected; }
+        void set_sample_sink(const Sample_sink& sink) { sample_sink = sink; }
+        void set_finish_reason(size_t index, string&& reason)          // 记录第index个样本的结束原因
+        {
+            string& reason_of {(index == 0) ? finish_reason : extra(index).sample.finish_reason};
+            if (reason_of.empty())
+                ++finished_samples;
+            reason_of = std::move(reason);
+        }
+        const string& get_finish_reason() const { return finish_reason; }
+        bool complete() const { return finished_samples>=samples_expected and (not usage_expected or used.reported); }           // 是否已收到所有样本的结束原因及用量，之后不会再有有用的事件
+        void finish()          // 响应的内容已经收齐，不必等服务器关闭响应
+        {
+            is_finished = true;
+            finished_at = steady_clock::now();
+        }
+        bool finished() const { return is_finished; }
+        bool overdue() const { return steady_clock::now()-finished_at >= grace; }           // 收齐后服务器是否已超过宽限期仍不结束响应。响应的结尾通常紧随结束事件到达，让curl正常读完才能复用连接，提前中止会使连接被关闭
+        Sse_framer& framer() { return frame; }           // 本次请求的响应分帧状态
+        Delta& delta() { return parsed; }          // 解析事件用的增量，各次写回调共用同一份缓冲
+        void set_usage(const Usage& reported) { used = reported; }
+        Usage get_usage() const          // 本次调用的用量，模型调用工具时包括此前各轮请求
+        {
+            Usage sum {earlier};
+            return sum += used;
+        }
+        string& tail(size_t index, bool reasoning)           // 第index个样本上一个增量末尾不完整的UTF-8字节，留给同一文本流的下一个增量
+        {
+            if (index != 0)
+                return extra(index).tails[reasoning];
+            return (reasoning) ? reasoning_tail : answer_tail;
+        }
+        void add_sample(size_t index, string&& token, bool reasoning)          // 处理第index(>0)个样本的token：记入该样本，再交给样本回调。这些token不参与合并
+        {
+            if (not mark_delivered())
+                return;
+            Sample& sample {extra(index).sample};
+            ((reasoning) ? sample.reasoning : sample.answer).append(token);
+            if (sample_sink and not sample_sink(index, std::move(token), reasoning))
+                cancel();
+        }
+        vector<Sample> take_samples(const string& reasoning_0)           // 取出本次调用的全部样本，第0个样本的深度思考由调用者给出。只生成一个样本时为空
+        {
+            vector<Sample> samples;
+            if (samples_expected<2 and extras.empty())
+                return samples;
+            samples.push_back(Sample{answer,reasoning_0,finish_reason});
+            for (auto& i : extras)
+                samples.push_back(std::move(i.sample));
+            extras.clear();
+            return samples;
+        }
+        struct Tool_run {            // 本轮中模型发起的一次工具调用
+            Tool_call call;          // 启动前是流中拼出的UTF-8，启动时转为程序编码
+            bool started {};
+            future<string> result;
+        };
+        void set_tools(const vector<Tool>* registered) { tools = registered; }
+        const Tool* find_tool(string_view name) const          // 按名字查找注册的工具，未找到时为空
+        {
+            if (tools)
+                for (auto& i : *tools)
+                    if (i.name == name)
+                        return &i;
+            return nullptr;
+        }
+        bool add_tool_fragment(size_t index, string&& id, string&& name, string_view arguments)          // 把工具调用的一段增量拼入第index个调用，返回是否继续
+        {
+            if (not mark_delivered())
+                return false;
+            if (index<runs.size() and not id.empty() and not runs[index].call.id.empty() and runs[index].call.id!=id)           // 有的服务器不给index，以id区分不同的调用
+                index = runs.size();
+            if (index >= runs.size()) {
+                index = runs.size();
+                runs.emplace_back();
+            }
+            Tool_call& call {runs[index].call};
+            if (not id.empty())
+                call.id = std::move(id);
+            if (not name.empty())
+                call.name = std::move(name);
+            call.arguments.append(arguments);
+            return true;
+        }
+        vector<Tool_run>& tool_runs() { return runs; }
+        string& tool_exchange() { return exchange; }           // 此前各轮的工具调用及结果在请求体中的json(UTF-8)，接在问题之后
+        void add_tool_call(Tool_call&& call) { calls.push_back(std::move(call)); }
+        vector<Tool_call> take_tool_calls() { return std::move(calls); }           // 本次调用中完成的全部工具调用
+        string_view round_answer() const { return string_view{answer}.substr(round_begin); }           // 本轮请求生成的答案
+        void set_coalescing(const Coalescing& policy) { coalescing = policy; }
+        bool due() const             // 缓冲中的token是否该交出了
+        {
+            if (pending.empty())
+                return false;
+            return (coalescing.bytes and pending.length()>=coalescing.bytes) or (coalescing.window.count() and steady_clock::now()-pending_since>=coalescing.window);
+        }
+        steady_clock::time_point next_check() const          // progress下一次必须被调用的时刻：最近的期限、收齐后宽限期满时、合并缓冲中最早的token等满window时，最迟cancel_poll之后，以便没有数据时也能及时发现其他线程的取消
+        {
+            if (is_finished)
+                return finished_at+grace;
+            auto next = checked+cancel_poll;
+            if (deadlines.total.count())
+                next = std::min(next, called+deadlines.total);
+            if (not has_delivered and deadlines.first_token.count())
+                next = std::min(next, started+deadlines.first_token);
+            if (has_delivered and deadlines.token_gap.count())
+                next = std::min(next, last_token+deadlines.token_gap);
+            if (not pending.empty() and coalescing.window.count())
+                next = std::min(next, pending_since+coalescing.window);
+            return next;
+        }
+        void begin(const Deadlines& limits, const Cancel_token& token)           // 开始一次调用，总期限从此刻算起，重试和工具调用的后续请求都计算在内。此前对token的触发不影响本次调用
+        {
+            deadlines = limits;
+            called = steady_clock::now();
+            cancel_token = token;
+            cancel_since = token.state();
+            earlier = used = Usage{};
+        }
+        bool within_total(milliseconds delay)          // 等待delay后是否仍在总期限内，否则记下Timeout_error
+        {
+            if (not deadlines.total.count() or steady_clock::now()+delay < called+deadlines.total)
+                return true;
+            fail(std::make_exception_ptr(Timeout_error{Deadline::total}));
+            return false;
+        }
+        bool backoff(milliseconds delay)           // 重试前等待delay，期间可被取消。返回是否可以重试，等不到重试就会超过总期限时立即放弃
+        {
+            if (not within_total(delay))
+                return false;
+            auto until = steady_clock::now()+delay;
+            for (auto now = steady_clock::now(); now<until; now=steady_clock::now()) {
+                if (cancelled())
+                    return false;
+                std::this_thread::sleep_for(std::min<steady_clock::duration>(until-now, milliseconds{20}));
+            }
+            return true;
+        }
+        void start()           // 开始一次请求，首token与token间隔的期限从此刻算起
+        {
+            frame.reset();
+            answer_tail.clear();
+            reasoning_tail.clear();
+            pending.clear();
+            earlier += used;
+            used = Usage{};
+            finish_reason.clear();
+            extras.clear();
+            finished_samples = 0;
+            runs.clear();
+            round_begin = answer.length();
+            is_finished = false;
+            started = last_token = checked = steady_clock::now();
+        }
+        bool expired()           // 检查是否已被中止、取消或超过期限，超过期限时记下Timeout_error。收齐之后不再检查期限
+        {
+            checked = steady_clock::now();
+            if (stopped())
+                return true;
+            if (is_finished)
+                return false;
+            auto now = steady_clock::now();
+            Deadline exceeded;
+            if (deadlines.total.count() and now-called>=deadlines.total)
+                exceeded = Deadline::total;
+            else if (not has_delivered and deadlines.first_token.count() and now-started>=deadlines.first_token)
+                exceeded = Deadline::first_token;
+            else if (has_delivered and deadlines.token_gap.count() and now-last_token>=deadlines.token_gap)
+                exceeded = Deadline::token_gap;
+            else
+                return false;
+            fail(std::make_exception_ptr(Timeout_error{exceeded}));
+            return true;
+        }
+        void check() const             // 若回调中发生过异常则重新抛出
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
         virtual ~Message_func() { }
     protected:
         void add_ans(string_view ans) { answer.append(ans); }
+        template<typename Emit>
+        void push(string&& token, bool reasoning, Emit emit)           // 按合并策略交出token，emit(string&& text, bool reasoning)调用回调函数。深度思考与答案之间切换时先交出缓冲，二者不会合并到一起
+        {
+            if (not coalescing.bytes and not coalescing.window.count()) {
+                emit(std::move(token), reasoning);
+                return;
+            }
+            if (not pending.empty() and pending_reasoning!=reasoning)
+                flush(emit);
+            if (pending.empty()) {
+                pending = std::move(token);
+                pending_reasoning = reasoning;
+                pending_since = steady_clock::now();
+            }
+            else
+                pending.append(token);
+            if (due())
+                flush(emit);
+        }
+        template<typename Emit>
+        void flush(Emit emit)          // 交出缓冲中的token
+        {
+            if (pending.empty())
+                return;
+            string text {std::move(pending)};
+            pending.clear();
+            emit(std::move(text), pending_reasoning);
+        }
+        struct Extra {             // 第0个以外的样本及其UTF-8尾部
+            Sample sample;
+            string tails[2];
+        };
+        Extra& extra(size_t index)           // 第index(>0)个样本，不存在时添加
+        {
+            if (extras.size() < index)
+                extras.resize(index);
+            return extras[index-1];
+        }
+        bool mark_delivered()          // 记录即将交出一个token，返回是否可以交出
+        {
+            if (not has_delivered and gate and not gate()) {
+                stop();
+                return false;
+            }
+            has_delivered = true;
+            if (deadlines.token_gap.count())
+                last_token = steady_clock::now();
+            return true;
+        }
     private:
         string answer;
         int prog_encode;
+        exception_ptr error;
+        bool has_delivered {};
+        bool is_stopped {};
+        bool is_cancelled {};
+        function<bool()> gate;
+        Cancel_token cancel_token;
+        unsigned long cancel_since {};
+        Deadlines deadlines;
+        steady_clock::time_point called;
+        steady_clock::time_point started;
+        steady_clock::time_point last_token;
+        steady_clock::time_point checked;            // 上一次检查取消与期限的时刻
+        Sse_framer frame;
+        Delta parsed;
+        string answer_tail;
+        string reasoning_tail;
+        Usage used;          // 当前请求的用量
+        Usage earlier;           // 本次调用此前各轮请求的用量之和
+        bool usage_expected {};
+        string finish_reason;
+        vector<Extra> extras;
+        size_t samples_expected {1};
+        size_t finished_samples {};
+        Sample_sink sample_sink;
+        const vector<Tool>* tools {};
+        vector<Tool_run> runs;
+        vector<Tool_call> calls;
+        string exchange;
+        size_t round_begin {};
+        bool is_finished {};
+        steady_clock::time_point finished_at;
+        static constexpr milliseconds grace {100};           // 收齐后等服务器结束响应的时长
+        static constexpr milliseconds cancel_poll {20};          // 等待数据时检查取消标志的间隔
+        Coalescing coalescing;
+        string pending;          // 合并中尚未交出的token
+        bool pending_reasoning {};
+        steady_clock::time_point pending_since;
     };
     
-    class Reasonal_message : public Message_func {       // Reasonal_message类是用户提供的深度思考回调函数和本次LLM生成的结果的绑定，深度思考结果与答案结果保存在不同地方
+    template<typename Func =Reason_sink>
+    class Reasonal_message : public Message_func {       // Reasonal_message类是用户提供的深度思考回调函数和本次LLM生成的结果的绑定，深度思考结果与答案结果保存在不同地方。Func是回调函数的类型，token直接调用它而不经过虚函数
     public:
-        Reasonal_message(int prog_encode, function<void(string&&, bool)> func) : Message_func{prog_encode}, func{func} { }
-        void reason(string&& r)        // 调用回调函数处理深度思考token，并记录该token
+        Reasonal_message(int prog_encode, Func func) : Message_func{prog_encode}, func{std::move(func)} { }
+        void set_retention(const Reasoning_policy& retention) { policy = retention; }
+        void reason(string&& r)        // 调用回调函数处理深度思考token，并按保留策略记录该token
         {
-            reasoning.append(r);
-            func(std::move(r), true);
+            if (not mark_delivered())
+                return;
+            retain(r);
+            push(std::move(r), true, emitter());
+        }
+        string&& remember_reasoning()          // 取出内存中保留的深度思考，写入文件的部分此时落盘
+        {
+            if (policy.retention == Retention::tail)
+                trim();
+            if (spill.is_open()) {
+                spill.close();
+                if (not spill)
+                    throw LLM_error{"无法写入深度思考文件"};
+            }
+            return std::move(reasoning);
         }
-        string&& remember_reasoning() { return std::move(reasoning); }
-        void operator()(string&& ans) override       // 调用回调函数处理LLM生成的token，并记录该token
+        const Reasoning_handle& spilled() const { return handle; }
+        void operator()(string&& ans)        // 调用回调函数处理LLM生成的token，并记录该token
         {
+            if (not mark_delivered())
+                return;
             add_ans(ans);
-            func(std::move(ans), false);
+            push(std::move(ans), false, emitter());
         }
+        void flush() { Message_func::flush(emitter()); }           // 把合并中的token交给回调函数
     private:
-        function<void(string&&, bool)> func;
+        Func func;
         string reasoning;
+        Reasoning_policy policy;
+        ofstream spill;
+        Reasoning_handle handle;
+        void retain(string_view r)
+        {
+            switch (policy.retention) {
+            case Retention::keep:
+                reasoning.append(r);
+                break;
+            case Retention::tail:
+                reasoning.append(r);
+                if (reasoning.length() >= 2*policy.tail_bytes+4096)           // 攒够一定长度才截断，均摊搬移的开销
+                    trim();
+                break;
+            case Retention::spill:
+                if (not spill.is_open()) {
+                    spill.open(policy.spill_file, std::ios::binary|std::ios::app);
+                    spill.seekp(0, std::ios::end);
+                    handle = Reasoning_handle{policy.spill_file,static_cast<long long>(spill.tellp()),0};
+                }
+                spill.write(r.data(), r.length());
+                if (not spill)
+                    throw LLM_error{"无法写入深度思考文件"};
+                handle.length += r.length();
+                break;
+            case Retention::discard:
+                break;
+            }
+        }
+        void trim()          // 只留最后tail_bytes字节，截断处前移到字符边界，因此可能多留一个字符的前几个字节，但不会把非空的深度思考截成空
+        {
+            if (reasoning.length() <= policy.tail_bytes)
+                return;
+            reasoning.erase(0, boundary(reasoning.length()-policy.tail_bytes));
+        }
+        size_t boundary(size_t cut) const            // cut处或之前最近的字符边界。UTF-8从cut向前跳过后续字节；双字节的ANSI编码(如GBK)的后续字节与单字节字符重叠，只能从开头逐个识别前导字节，保留的部分总是从字符边界开始
+        {
+            if (prog_enc() == CP_UTF8) {
+                while (cut>0 and (static_cast<unsigned char>(reasoning[cut])&0xC0)==0x80)
+                    --cut;
+                return cut;
+            }
+            size_t pos {};
+            while (pos < cut) {
+                size_t next {pos+((IsDBCSLeadByteEx(prog_enc(), static_cast<BYTE>(reasoning[pos]))) ? 2 : 1)};
+                if (next > cut)          // 该双字节字符跨过了cut
+                    break;
+                pos = next;
+            }
+            return pos;
+        }
+        auto emitter()
+        {
+            return [this](string&& text, bool reasoning) {
+                if (not call_sink(func, std::move(text), reasoning))
+                    cancel();
+            };
+        }
     };
     
-    class Chat_message : public Message_func {       // Chat_message类是回调函数与生成结果的绑定
+    template<typename Func =Chat_sink>
+    class Chat_message : public Message_func {       // Chat_message类是回调函数与生成结果的绑定。Func是回调函数的类型
     public:
-        Chat_message(int prog_encode, function<void(string&&)> func) : Message_func{prog_encode}, func{func} { }
-        void operator()(string&& ans) override       // 调用回调函数处理LLM生成的token，并记录该token
+        Chat_message(int prog_encode, Func func) : Message_func{prog_encode}, func{std::move(func)} { }
+        void operator()(string&& ans)        // 调用回调函数处理LLM生成的token，并记录该token
         {
+            if (not mark_delivered())
+                return;
             add_ans(ans);
-            func(std::move(ans));
+            push(std::move(ans), false, emitter());
         }
+        void flush() { Message_func::flush(emitter()); }           // 把合并中的token交给回调函数
     private:
-        function<void(string&&)> func;
+        Func func;
+        auto emitter()
+        {
+            return [this](string&& text, bool) {
+                if (not call_sink(func, std::move(text)))
+                    cancel();
+            };
+        }
     };
     
+    using Done_func = function<void(exception_ptr)>;       // 异步调用结束时的回调，生成出错时参数为对应的异常，否则为空
+    
     class LLM {        // LLM类是一个对话模型
+        friend class Hedge;
     public:
-        LLM(string&& url, string&& model, string&& key, int code_encode, int prog_encode) : url{std::move(url)}, model{std::move(model)}, key{std::move(key)}, code_encode{code_encode}, prog_encode{prog_encode}, temperature{-1} { }
+        LLM(string&& url, string&& model, string&& key, int code_encode, int prog_encode, string&& unix_socket ={}) : url{std::move(url)}, unix_socket{std::move(unix_socket)}, model{std::move(model)}, key{std::move(key)}, code_encode{code_encode}, prog_encode{prog_encode}, temperature{-1}
+        {
+            make_headers();
+            warm_due = auto_warm;
+        }
         void read_file(const string& file, int file_encode =CP_UTF8);             // 从文件中读取对话历史，若文件不存在就抛出Not_found_error异常，若文件格式不对抛出File_format_error异常
         
         bool save_file(const string& file, int file_encode =CP_UTF8);             // 保存对话历史到文件中，返回是否保存成功
@@ -97,6 +1113,7 @@ namespace LLM_impl {             // 该名字空间负责实现大模型的基
         void set_system(string&& system) { sys = std::move(system); }
         virtual void get(string&& question) = 0;             // 调用大模型
         void get(const string& question) { get(string{question}); }
+        virtual void get(Curl::Multi& multi, string&& question, Done_func done ={}) = 0;          // 把调用加入multi的事件循环后立即返回，生成结束后记录历史并调用done。本对象须存活到调用结束
         void add_history(string&& ques, string&& ans)          // 设置历史记录，可以用于训练模型
         {
             history.push_back(std::move(ques));
@@ -121,9 +1138,76 @@ namespace LLM_impl {             // 该名字空间负责实现大模型的基
             return (locat<history.size()) ? complex<string>{history[locat-1],history[locat]} : throw Not_found_error{};
         }
         void clear_history() { history.clear(); }
+        const Usage& get_usage() const { return usage; }           // 上一次调用的token用量，模型调用工具时是各轮请求之和
+        const string& get_finish_reason() const { return finish_reason; }          // 上一次调用的结束原因，如stop、length、content_filter、tool_calls。被取消或连接中断时为空
+        void set_samples(size_t n, Sample_sink sink ={})          // 设置每次调用生成n个样本，第0个样本照常交给回调函数并记入历史，其余样本交给sink
+        {
+            set("n", std::to_string(n));
+            sample_sink = std::move(sink);
+        }
+        const vector<Sample>& get_samples() const { return samples; }          // 上一次调用的全部样本，只生成一个样本时为空
+        void add_tool(string&& name, string&& description, string&& parameters, Tool_handler handler)           // 注册一个工具，模型调用它时在工作线程中执行handler，结果齐全后自动发出后续请求。parameters是参数的JSON Schema
+        {
+            tools.push_back(Tool{std::move(name),std::move(description),std::move(parameters),std::move(handler)});
+        }
+        void clear_tools() { tools.clear(); }
+        void set_tool_rounds(size_t rounds) { tool_rounds = rounds; }          // 设置一次调用中最多自动发出几轮后续请求，超过时抛出LLM_error
+        const vector<Tool_call>& get_tool_calls() const { return tool_calls; }           // 上一次调用中完成的全部工具调用及结果
+        virtual void choose_sample(size_t index)           // 用上一次调用的第index个样本替换历史记录中最近的答案，若历史记录为空则抛出Empty_history_error，若没有该样本则抛出Not_found_error
+        {
+            if (history.empty())
+                throw Empty_history_error{};
+            if (index >= samples.size())
+                throw Not_found_error{};
+            history.back() = samples[index].answer;
+            finish_reason = samples[index].finish_reason;
+        }
         void set_temperature(double temp) { temperature = temp; }
         void set_model(string&& m) { model = std::move(m); }
         void set(string&& property, string&& value, bool quote_value =false);             // 设定模型的某个调用参数，如果quote_value为true，就用引号括住value。
+        void set_retry(Curl::Retry_policy policy) { retry_policy = policy; }       // 设置失败重试策略。只有尚未收到任何token时才会重试
+        void set_deadlines(const Deadlines& limits)          // 设置调用的期限，超过时调用被中止并抛出Timeout_error
+        {
+            deadlines = limits;
+            auto_warmup();
+        }
+        void set_coalescing(const Coalescing& policy) { coalescing = policy; }           // 设置合并token的策略，减少回调函数收到的零碎小段。深度思考与答案的分界保持不变
+        void set_cancel_token(const Cancel_token& token) { cancel_token = token; }         // 设置之后各次调用使用的取消标志，在其他线程中触发即可中止生成
+        const Cancel_token& get_cancel_token() const { return cancel_token; }
+        void set_stream_upload(bool stream) { stream_upload = stream; }          // 设置是否流式上传请求体：边逐条序列化历史记录边发送，不在内存中拼出完整请求体。请求进行中不要修改历史记录
+        bool warmup(bool background =false)          // 提前建立到服务器的连接(DNS、TCP、TLS)，供之后的阻塞调用复用，Multi中的调用用Multi自己的连接。返回是否连接成功；background为true时在后台线程中进行并立即返回true
+        {
+            warm_due = false;
+            if (background) {
+                warming = std::async(std::launch::async, [url=url, unix_socket=unix_socket, transport=transport, connect=deadlines.connect] {
+                    try {
+                        auto curl = open(transport, url, unix_socket);
+                        curl->set_profile(Curl::Profile::streaming);
+                        if (connect.count())
+                            curl->set_connect_timeout(connect);
+                        curl->warmup();
+                    }
+                    catch (Curl::Network_error) { }
+                }).share();
+                return true;
+            }
+            try {
+                auto curl = open(transport, url, unix_socket);
+                curl->set_profile(Curl::Profile::streaming);
+                if (deadlines.connect.count())
+                    curl->set_connect_timeout(deadlines.connect);
+                return curl->warmup().code == CURLE_OK;
+            }
+            catch (Curl::Network_error) {
+                return false;
+            }
+        }
+        static void set_auto_warmup(bool warm) { auto_warm = warm; }         // 设置之后创建的对象是否自动于后台预热连接。预热在对象首次设置传输方式、url、Unix域套接字或期限时开始，都没有设置时在首次阻塞调用时开始
+        void set_transport(Curl::Transport::Factory factory)           // 设置各次调用的传输方式，为空时经网络传输。Curl::Mock::factory可在进程内回放脚本化的响应
+        {
+            transport = std::move(factory);
+            auto_warmup();
+        }
         
         static string encode(int from, int to, const char* source)       // 将source从from编码转为to编码。source不能为空指针。这段代码是deepseek写的，我也不清楚
         {
@@ -138,95 +1222,452 @@ namespace LLM_impl {             // 该名字空间负责实现大模型的基
             return string{gbuf.get()};
         }
         string encode(const char* source) const { return encode(code_encode, prog_encode, source); }
+        static string transcode(int from, int to, string_view source)          // 与encode相同，但source不必以'\0'结尾，也可以含有'\0'
+        {
+            if (from==to or source.empty())
+                return string{source};
+            int length {static_cast<int>(source.length())};
+            int wlen {MultiByteToWideChar(from, 0, source.data(), length, nullptr, 0)};
+            std::wstring wbuf(wlen, L'\0');
+            MultiByteToWideChar(from, 0, source.data(), length, wbuf.data(), wlen);
+            int glen {WideCharToMultiByte(to, 0, wbuf.data(), wlen, nullptr, 0, nullptr, nullptr)};
+            string result(glen, '\0');
+            WideCharToMultiByte(to, 0, wbuf.data(), wlen, result.data(), glen, nullptr, nullptr);
+            return result;
+        }
         virtual ~LLM() { }
     protected:
-        static string read_key(string& json, string_view key)          // 检查json字符串是否没有异常，若无异常则在json字符串中读取对应键的内容（不转义），若有异常则抛出。json是流式调用LLM时生成的json结果
-        {
-            if (json.find(R"("error")")!=string::npos or json.find("Failed")==0)
-                throw LLM_error{std::move(json)};
-            string quote_key {key};
-            quote(quote_key);
-            auto index = json.find(quote_key);
-            if (index == string::npos)
-                throw Not_found_error{};
-            string result;
-            bool in {};
-            bool escape_mode {};
-            for (auto start=index+quote_key.length(); start!=json.length(); ++start) {
-                switch (json[start]) {
-                case '\\':
-                    escape_mode = not escape_mode;
-                    break;
-                case '"':
-                    if (not escape_mode)
-                        in = not in;
+        void auto_warmup()           // 对象要求自动预热且尚未预热时在后台预热。构造时连接的设置可能还没有完成，推迟到首次设置或首次阻塞调用时
+        {
+            if (warm_due)
+                warmup(true);
+        }
+        void record(string&& question, Message_func& mfunc, const string& reasoning ={})          // 调用结束后记录问答、用量、结束原因和各个样本，历史记录中的答案是第0个样本
+        {
+            samples = mfunc.take_samples(reasoning);
+            tool_calls = mfunc.take_tool_calls();
+            add_history(std::move(question), mfunc.get_ans());
+            usage = mfunc.get_usage();
+            finish_reason = mfunc.get_finish_reason();
+        }
+        size_t requested_samples() const          // 用set_samples或set设置的n，未设置时为1
+        {
+            for (auto i=settings.begin(); i!=settings.end(); i+=2)
+                if (*i == "n")
+                    return static_cast<size_t>(std::max(1L, std::atol(i[1].c_str())));
+            return 1;
+        }
+        bool requests_usage() const { return std::find(settings.begin(), settings.end(), "stream_options") == settings.end(); }          // 是否在请求体中要求报告用量，用set设置了stream_options时由调用者决定
+        static void read_delta(string_view event, Delta& delta, int prog_encode)          // 解析一个事件中各个choice的增量，不是json的事件(如[DONE])没有增量。服务器返回错误时抛出LLM_error
+        {
+            delta.count = 0;
+            delta.usage.reported = false;
+            delta.done = (event == "[DONE]");
+            Json_reader reader {event};
+            if (reader.peek() != '{') {
+                if (event.substr(0, 6) == "Failed")
+                    throw LLM_error{transcode(CP_UTF8, prog_encode, event)};
+                return;
+            }
+            try {
+                reader.begin_object();
+                for (string_view key; reader.next_key(key); )
+                    if (key=="error" and reader.peek()!='n')
+                        throw LLM_error{transcode(CP_UTF8, prog_encode, event)};
+                    else if (key=="usage" and reader.peek()!='n')
+                        read_usage(reader, delta.usage);
+                    else if (key == "choices") {
+                        reader.begin_array();
+                        while (reader.next_item()) {
+                            if (delta.count == delta.choices.size())
+                                delta.choices.emplace_back();
+                            Choice& choice {delta.choices[delta.count]};
+                            choice.index = delta.count++;           // 没有index字段时按位置编号
+                            read_choice(reader, choice);
+                        }
+                    }
                     else
-                        escape_mode = false;
-                    break;
-                case ' ':
-                case ':':
-                    if (not in)
-                        continue;
-                    break;
-                case ',':
-                case '}':
-                    if (not in)
-                        return result;
-                    break;
-                default:
-                    escape_mode = false;
-                    break;
-                }
-                result.push_back(json[start]);
+                        reader.skip();
             }
-            return result;
+            catch (Json_error) {
+                throw LLM_error{transcode(CP_UTF8, prog_encode, event)};
+            }
+        }
+        static void to_prog(string& text, string& tail, int prog_encode)           // 把UTF-8的text就地转为程序编码。先接上tail，末尾不完整的字符再存入tail，与下一段拼接后才转换
+        {
+            if (not tail.empty()) {
+                text.insert(0, tail);
+                tail.clear();
+            }
+            size_t complete {complete_utf8(text)};
+            if (complete < text.length()) {
+                tail.assign(text, complete);
+                text.resize(complete);
+            }
+            if (prog_encode != CP_UTF8)
+                text = transcode(CP_UTF8, prog_encode, text);
+        }
+        static size_t complete_utf8(string_view text)          // text中到最后一个完整UTF-8字符为止的长度
+        {
+            size_t end {text.length()};
+            for (size_t back {1}; back<=3 and back<=end; ++back) {
+                auto c = static_cast<unsigned char>(text[end-back]);
+                if ((c&0xC0) == 0x80)            // 后续字节
+                    continue;
+                size_t need {(c>=0xF0) ? 4u : (c>=0xE0) ? 3u : (c>=0xC0) ? 2u : 1u};
+                return (need > back) ? end-back : end;
+            }
+            return end;
         }
-        Curl::Curl set_curl(string_view question) const        // 生成本次调用所需的curl对象
+        static unique_ptr<Curl::Transport> open(const Curl::Transport::Factory& transport, const string& url, const string& unix_socket)          // 按传输方式创建传输对象，未设置时使用curl
         {
-            Curl::Curl curl {url};
-            curl.add_header("Content-Type", "application/json");
-            curl.add_header("Authorization", string{"Bearer "}+key);
-            curl.set_body(encode(prog_encode, CP_UTF8, request_body(question).c_str()));
+            unique_ptr<Curl::Transport> curl {(transport) ? transport(url, unix_socket) : unique_ptr<Curl::Transport>{new Curl::Curl{url,unix_socket}}};
+            if (not curl)
+                throw Curl::Network_error{};
             return curl;
         }
-        int prog_enc() const { return prog_encode; }
-        int code_enc() const { return code_encode; }
-        static void del_quote(string& quoted) { quoted = quoted.substr(1, quoted.length()-2); }
-        static void quote(string& will_quote) { will_quote = '"'+will_quote+'"'; }
-        auto func_call_back() const { return call_back_func; }
-        void set_call_back(function<size_t(char*, size_t, size_t, Message_func*)> func) { call_back_func = func; }
-        static string parse(string_view str)             // 解析转义字符
+        unique_ptr<Curl::Transport> set_curl(string_view question, string_view exchange) const        // 生成本次调用所需的传输对象，exchange是接在问题后的工具调用消息
         {
-            string res;
-            for (auto i=str.begin(); i!=str.end(); ++i)
-                if (*i == '\\')
-                    switch (*++i) {
-                    case 'n':
-                        res.push_back('\n');
-                        break;
-                    case '\\':
-                        res.push_back('\\');
-                        break;
-                    case '"':
-                        res.push_back('"');
-                        break;
-                    default:
-                        res.push_back('\\');
-                        --i;
+            auto curl = open(transport, url, unix_socket);
+            curl->set_profile(Curl::Profile::streaming);           // 所有调用都是流式的
+            curl->set_headers(headers);
+            if (stream_upload)
+                curl->set_body(body_source(question, exchange));
+            else
+                curl->set_body(request_body(question, exchange));
+            return curl;
+        }
+        template<typename Message>
+        unique_ptr<Curl::Transport> set_curl(string_view question, Message& mfunc) const       // 生成本次调用所需的传输对象，生成结果交给mfunc
+        {
+            auto curl = set_curl(question, string_view{mfunc.tool_exchange()});
+            size_t (*write_func)(char*, size_t, size_t, Message*) {write<Message>};
+            curl->set_write_func(reinterpret_cast<void*>(write_func));
+            curl->set_write_data(&mfunc);
+            mfunc.start();
+            mfunc.set_coalescing(coalescing);
+            mfunc.expect_usage(requests_usage());
+            mfunc.expect_samples(requested_samples());
+            mfunc.set_sample_sink(sample_sink);
+            mfunc.set_tools(&tools);
+            mfunc.set_gate(gate);
+            if (deadlines.connect.count())
+                curl->set_connect_timeout(deadlines.connect);
+            int (*progress_func)(Message*, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {progress<Message>};
+            curl->set_progress_func(reinterpret_cast<void*>(progress_func));           // 即使没有期限，也要在等待数据时检查取消标志
+            curl->set_progress_data(&mfunc);
+            long (*timer_func)(Message*) {timer<Message>};
+            curl->set_timer_func(reinterpret_cast<void*>(timer_func));           // 事件循环按它准时调用progress，不必等curl约每秒一次的调用
+            return curl;
+        }
+        void await_warmup(const Message_func& mfunc) const          // 后台预热已走完一部分握手，等它完成比重新建立连接更快。最多等到连接期限(未设置时1秒)，被取消时立即返回，之后由调用自己连接
+        {
+            if (not warming.valid())
+                return;
+            auto limit = steady_clock::now()+((deadlines.connect.count()) ? deadlines.connect : milliseconds{1000});
+            while (warming.wait_for(milliseconds{20}) != std::future_status::ready)
+                if (mfunc.cancelled() or steady_clock::now()>=limit)
+                    return;
+        }
+        template<typename Message>
+        void request(string_view question, Message& mfunc) const          // 阻塞执行一次调用，失败时按重试策略重试，最终失败时抛出异常
+        {
+            await_warmup(mfunc);
+            for (int attempt {}; ; ++attempt) {
+                Curl::Result result {set_curl(question, mfunc)->perform()};
+                finish_stream(mfunc);
+                auto delay = retry_policy.next_delay(attempt, result);
+                if (not delay or mfunc.delivered() or mfunc.cancelled() or mfunc.finished()) {
+                    check(result, mfunc);
+                    return;
+                }
+                mfunc.fail(nullptr);
+                if (not mfunc.backoff(*delay)) {
+                    check(result, mfunc);
+                    return;
+                }
+            }
+        }
+        template<typename Message>
+        void request(Curl::Multi& multi, shared_ptr<string> question, shared_ptr<Message> mfunc, Done_func finish, int attempt =0) const          // 把调用加入multi，失败时按重试策略等待后重新加入，最终结果交给finish
+        {
+            auto report = [this, mfunc, finish](const Curl::Result& result) {
+                exception_ptr error;
+                try {
+                    check(result, *mfunc);
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+                finish(error);
+            };
+            auto done = [this, &multi, question, mfunc, finish, attempt, report](const Curl::Result& result) {
+                finish_stream(*mfunc);
+                auto delay = retry_policy.next_delay(attempt, result);
+                if (delay and not mfunc->delivered() and not mfunc->cancelled() and not mfunc->finished()) {
+                    mfunc->fail(nullptr);
+                    if (mfunc->within_total(*delay)) {          // 等待期间不占用连接，也不计入首token与token间隔的期限，到期后才生成传输对象
+                        auto due = steady_clock::now()+*delay;
+                        multi.add_wait([mfunc, due] { return mfunc->cancelled() or steady_clock::now()>=due; }, [this, &multi, question, mfunc, finish, attempt, report, result] {
+                            if (mfunc->cancelled())
+                                report(result);
+                            else
+                                request(multi, question, mfunc, finish, attempt+1);
+                        });
+                        return;
+                    }
+                }
+                report(result);
+            };
+            try {
+                multi.add(set_curl(*question, *mfunc), done);
+            }
+            catch (...) {          // 首次加入失败直接抛给调用者，重试时失败则交给finish
+                if (attempt == 0)
+                    throw;
+                finish(std::current_exception());
+            }
+        }
+        template<typename Message>
+        void converse(string_view question, Message& mfunc) const          // 阻塞执行一次调用。模型调用工具时等待结果并自动发出后续请求，直到模型给出答案
+        {
+            mfunc.begin(deadlines, cancel_token);
+            for (size_t round {}; ; ++round) {
+                request(question, mfunc);
+                if (mfunc.tool_runs().empty() or mfunc.cancelled())
+                    return;
+                if (round == tool_rounds)
+                    throw LLM_error{"工具调用的轮数超过上限"};
+                follow_up(mfunc);
+            }
+        }
+        template<typename Message>
+        void converse(Curl::Multi& multi, shared_ptr<string> question, shared_ptr<Message> mfunc, Done_func finish, size_t round =0) const          // 把调用加入multi，模型调用工具时由multi等待结果齐全后加入后续请求，最终结果交给finish。等待工具结果时不阻塞multi的事件循环
+        {
+            if (round == 0)
+                mfunc->begin(deadlines, cancel_token);
+            request(multi, question, mfunc, [this, &multi, question, mfunc, finish, round](exception_ptr error) {
+                if (error or mfunc->tool_runs().empty() or mfunc->cancelled()) {
+                    finish(error);
+                    return;
+                }
+                try {
+                    if (round == tool_rounds)
+                        throw LLM_error{"工具调用的轮数超过上限"};
+                    start_tools(*mfunc, mfunc->tool_runs().size());             // 没有收到结束原因时，最后一个调用尚未启动
+                    multi.add_wait([mfunc] { return mfunc->cancelled() or tools_done(*mfunc); }, [this, &multi, question, mfunc, finish, round] {
+                        if (mfunc->cancelled()) {            // 不再等待工具结果，已生成的部分照常作为答案
+                            finish(nullptr);
+                            return;
+                        }
+                        try {
+                            follow_up(*mfunc);
+                            converse(multi, question, mfunc, finish, round+1);
+                        }
+                        catch (...) {
+                            finish(std::current_exception());
+                        }
+                    });
+                }
+                catch (...) {
+                    finish(std::current_exception());
+                }
+            });
+        }
+        template<typename Message>
+        static void finish_stream(Message& mfunc)          // 响应结束后补一个换行，处理没有以换行结尾的最后一行，再整体解析非SSE的内容(如出错时的json)，最后交出合并中的token
+        {
+            if (mfunc.stopped())
+                return;
+            if (mfunc.framer().pending()) {
+                char newline[] {"\n"};
+                write(newline, 1, 1, &mfunc);
+            }
+            try {
+                if (not mfunc.stopped() and not mfunc.framer().body().empty())
+                    read_delta(mfunc.framer().body(), mfunc.delta(), mfunc.prog_enc());
+                mfunc.flush();
+            }
+            catch (...) {
+                mfunc.fail(std::current_exception());
+            }
+        }
+        template<typename Message>
+        static size_t write(char* contents, size_t size, size_t nmemb, Message* ptr)           // 处理网络请求中每次返回的数据。按消息类型实例化，每个token都静态分派到用户回调
+        {
+            if (ptr->expired())          // 已取消或超过期限
+                return 0;
+            if (ptr->finished())             // 结束事件之后的数据直接丢弃
+                return size*nmemb;
+            try {
+                if (not contents)
+                    throw LLM_error{"服务器繁忙，请稍后再试。"};
+                Sse_framer& framer {ptr->framer()};
+                framer.feed(string_view{contents, size*nmemb});
+                Delta& delta {ptr->delta()};
+                for (string_view event; framer.next(event); ) {
+                    read_delta(event, delta, ptr->prog_enc());
+                    if (delta.usage.reported)
+                        ptr->set_usage(delta.usage);
+                    for (size_t i {}; i<delta.count; ++i) {
+                        Choice& choice {delta.choices[i]};
+                        if (choice.index >= ptr->samples())           // 超出请求数量的样本忽略
+                            continue;
+                        if (not deliver(*ptr, choice))
+                            return 0;
+                        if (choice.index==0 and not assemble_tools(*ptr, choice))
+                            return 0;
+                        if (not choice.finish_reason.empty())
+                            ptr->set_finish_reason(choice.index, std::move(choice.finish_reason));
+                    }
+                    if (delta.done or ptr->complete()) {           // 合并中的token立即交出，不等服务器结束响应
+                        ptr->finish();
+                        ptr->flush();
                         break;
                     }
+                }
+            }
+            catch (...) {                // 异常不能穿过curl，记下后中止请求
+                ptr->fail(std::current_exception());
+                return 0;
+            }
+            return size*nmemb;
+        }
+        template<typename Func>
+        static bool deliver(Reasonal_message<Func>& mfunc, Choice& delta)           // 把增量交给深度思考模型的回调，返回是否继续
+        {
+            if (delta.index != 0)
+                return deliver_sample(mfunc, delta);
+            to_prog(delta.reasoning, mfunc.tail(0, true), mfunc.prog_enc());
+            if (not delta.reasoning.empty()) {
+                mfunc.reason(std::move(delta.reasoning));
+                if (mfunc.stopped())
+                    return false;
+            }
+            return deliver_answer(mfunc, delta);
+        }
+        template<typename Func>
+        static bool deliver(Chat_message<Func>& mfunc, Choice& delta) { return (delta.index == 0) ? deliver_answer(mfunc, delta) : deliver_sample(mfunc, delta); }          // 把增量交给通用模型的回调，补全接口的text也在content中
+        template<typename Message>
+        static bool deliver_answer(Message& mfunc, Choice& delta)
+        {
+            to_prog(delta.content, mfunc.tail(0, false), mfunc.prog_enc());
+            if (not delta.content.empty()) {
+                mfunc(std::move(delta.content));
+                if (mfunc.stopped())
+                    return false;
+            }
+            return true;
+        }
+        static bool deliver_sample(Message_func& mfunc, Choice& delta)           // 把第0个以外样本的增量交给样本回调
+        {
+            for (bool reasoning : {true, false}) {
+                string& text {(reasoning) ? delta.reasoning : delta.content};
+                to_prog(text, mfunc.tail(delta.index, reasoning), mfunc.prog_enc());
+                if (not text.empty()) {
+                    mfunc.add_sample(delta.index, std::move(text), reasoning);
+                    if (mfunc.stopped())
+                        return false;
+                }
+            }
+            return true;
+        }
+        static bool assemble_tools(Message_func& mfunc, Choice& delta)           // 拼接第0个样本的工具调用。后一个调用开始时前面的调用已经完整，立即启动它们；结束原因到达时启动全部。返回是否继续
+        {
+            for (size_t i {}; i<delta.tool_count; ++i) {
+                Tool_fragment& fragment {delta.tools[i]};
+                if (not mfunc.add_tool_fragment(fragment.index, std::move(fragment.id), std::move(fragment.name), fragment.arguments))
+                    return false;
+            }
+            if (delta.tool_count or not delta.finish_reason.empty())
+                start_tools(mfunc, (delta.finish_reason.empty()) ? mfunc.tool_runs().size()-1 : mfunc.tool_runs().size());
+            return true;
+        }
+        static void start_tools(Message_func& mfunc, size_t end)           // 把前end个尚未启动的工具调用交给Tool_pool
+        {
+            auto& runs = mfunc.tool_runs();
+            for (size_t i {}; i<end and i<runs.size(); ++i) {
+                auto& run = runs[i];
+                if (run.started)
+                    continue;
+                run.started = true;
+                Tool_call& call {run.call};
+                call.id = transcode(CP_UTF8, mfunc.prog_enc(), call.id);
+                call.name = transcode(CP_UTF8, mfunc.prog_enc(), call.name);
+                call.arguments = transcode(CP_UTF8, mfunc.prog_enc(), call.arguments);
+                const Tool* tool {mfunc.find_tool(call.name)};
+                if (tool and tool->handler)
+                    run.result = Tool_pool::shared().submit([handler=tool->handler, arguments=call.arguments] { return handler(arguments); });
                 else
-                    res.push_back(*i);
-            return res;
+                    run.result = std::async(std::launch::deferred, [name=call.name] { return R"({"error": "unknown tool: )"+escape(name)+R"("})"; });
+            }
+        }
+        static bool tools_done(Message_func& mfunc)          // 本轮的工具调用是否都已有结果
+        {
+            for (auto& i : mfunc.tool_runs())
+                if (i.result.wait_for(milliseconds{}) == std::future_status::timeout)
+                    return false;
+            return true;
         }
-        static string escape(string_view str)          // 添加转义字符
+        static void check(const Curl::Result& result, const Message_func& mfunc)       // 调用失败时抛出异常：回调中记下的异常优先，其次是网络错误。被取消的调用不算失败
+        {
+            mfunc.check();
+            if (mfunc.cancelled() or mfunc.finished())           // 收齐后由本库中止的传输也算成功
+                return;
+            if (result.code == CURLE_OPERATION_TIMEDOUT)          // 只设置了连接超时，其余期限由progress检查
+                throw Timeout_error{Deadline::connect};
+            if (not result.ok())
+                throw Curl::Network_error{result};
+        }
+        template<typename Message>
+        static long timer(Message* mfunc)          // 距progress下一次必须被调用的毫秒数，负数表示没有
+        {
+            auto next = mfunc->next_check();
+            if (next == steady_clock::time_point::max())
+                return -1;
+            return static_cast<long>(std::max(milliseconds{}, std::chrono::ceil<milliseconds>(next-steady_clock::now())).count());
+        }
+        template<typename Message>
+        static int progress(Message* mfunc, curl_off_t, curl_off_t, curl_off_t, curl_off_t)          // 传输期间curl定期调用，到了timer给出的时刻事件循环也会调用，返回非0时中止请求。没有新token时也在这里交出等待够久的合并缓冲
+        {
+            if (mfunc->expired())
+                return 1;
+            if (mfunc->finished())           // 服务器发完结束事件后仍不关闭响应时不再等待
+                return mfunc->overdue();
+            try {
+                if (mfunc->due())
+                    mfunc->flush();
+            }
+            catch (...) {          // 异常不能穿过curl
+                mfunc->fail(std::current_exception());
+                return 1;
+            }
+            return mfunc->stopped();
+        }
+        int prog_enc() const { return prog_encode; }
+        int code_enc() const { return code_encode; }
+        static void quote(string& will_quote) { will_quote = '"'+will_quote+'"'; }
+        static string escape(string_view str)          // 添加转义字符，其余的控制字符写成\u00XX
         {
             string res;
+            res.reserve(str.length());
             for (auto ch : str)
                 switch (ch) {
                 case '\n':
                     res.append(R"(\n)");
                     break;
+                case '\t':
+                    res.append(R"(\t)");
+                    break;
+                case '\r':
+                    res.append(R"(\r)");
+                    break;
+                case '\b':
+                    res.append(R"(\b)");
+                    break;
+                case '\f':
+                    res.append(R"(\f)");
+                    break;
                 case '\\':
                     res.append(R"(\\)");
                     break;
@@ -234,13 +1675,21 @@ namespace LLM_impl {             // 该名字空间负责实现大模型的基
                     res.append(R"(\")");
                     break;
                 default:
-                    res.push_back(ch);
+                    if (static_cast<unsigned char>(ch) < 0x20) {
+                        constexpr char digits[] {"0123456789abcdef"};
+                        res.append(R"(\u00)");
+                        res.push_back(digits[ch>>4]);
+                        res.push_back(digits[ch&0xf]);
+                    }
+                    else
+                        res.push_back(ch);
                     break;
                 }
             return res;
         }
     private:
         string url;
+        string unix_socket;          // 非空时经该Unix域套接字连接，用于本机的网关或边车
         string model;
         string key;
         string sys;
@@ -248,137 +1697,302 @@ namespace LLM_impl {             // 该名字空间负责实现大模型的基
         vector<string> settings;
         int code_encode;
         int prog_encode;
-        string request_body(string_view question) const;        // 请求体
+        string request_body(string_view question, string_view exchange) const;        // 请求体(UTF-8)
+        
+        void make_headers() { headers = Curl::Curl::make_headers({"Content-Type: application/json", "Authorization: Bearer "+key, "Expect:"}); }          // 生成各次调用共用的请求头，修改key后需重新生成。"Expect:"让curl不必等待100 Continue
+        
+        Curl::Transport::Read_func body_source(string_view question, string_view exchange) const;           // 按消息逐段生成请求体的数据源，question和exchange须存活到请求结束
+        
+        bool body_segment(size_t index, string_view question, string_view exchange, size_t messages, string& segment) const;       // 生成请求体的第index段(UTF-8)，只使用前messages条历史记录。返回false表示已无更多段
+        
+        void follow_up(Message_func& mfunc) const;           // 等待本轮的工具结果，把工具调用及结果加入mfunc的后续请求
+        
+        string message(string_view role, const char* content) const;         // 一条消息的json(UTF-8)
+        
+        static void read_usage(Json_reader& reader, Usage& usage)          // 读取usage对象，兼容DeepSeek的prompt_cache_hit_tokens与OpenAI的prompt_tokens_details.cached_tokens
+        {
+            usage = Usage{};
+            usage.reported = true;
+            bool miss_reported {};
+            reader.begin_object();
+            for (string_view key; reader.next_key(key); )
+                if (key == "prompt_tokens")
+                    usage.prompt_tokens = reader.read_integer();
+                else if (key == "completion_tokens")
+                    usage.completion_tokens = reader.read_integer();
+                else if (key == "total_tokens")
+                    usage.total_tokens = reader.read_integer();
+                else if (key == "prompt_cache_hit_tokens")
+                    usage.cache_hit_tokens = reader.read_integer();
+                else if (key == "prompt_cache_miss_tokens") {
+                    usage.cache_miss_tokens = reader.read_integer();
+                    miss_reported = true;
+                }
+                else if ((key=="completion_tokens_details" or key=="prompt_tokens_details") and reader.peek()=='{') {
+                    bool completion {key == "completion_tokens_details"};
+                    reader.begin_object();
+                    for (string_view field; reader.next_key(field); )
+                        if (completion and field=="reasoning_tokens")
+                            usage.reasoning_tokens = reader.read_integer();
+                        else if (not completion and field=="cached_tokens" and not usage.cache_hit_tokens)
+                            usage.cache_hit_tokens = reader.read_integer();
+                        else
+                            reader.skip();
+                }
+                else
+                    reader.skip();
+            if (not miss_reported)
+                usage.cache_miss_tokens = usage.prompt_tokens-usage.cache_hit_tokens;
+        }
+        static void read_choice(Json_reader& reader, Choice& delta)           // 读取choices中的一项
+        {
+            delta.content.clear();
+            delta.reasoning.clear();
+            delta.tool_count = 0;
+            delta.finish_reason.clear();
+            reader.begin_object();
+            for (string_view key; reader.next_key(key); )
+                if (key == "index")
+                    delta.index = static_cast<size_t>(reader.read_integer());
+                else if (key == "delta") {
+                    reader.begin_object();
+                    for (string_view field; reader.next_key(field); )
+                        if (field == "content")
+                            reader.read_string(delta.content);
+                        else if (field == "reasoning_content")
+                            reader.read_string(delta.reasoning);
+                        else if (field=="tool_calls" and reader.peek()=='[') {
+                            reader.begin_array();
+                            while (reader.next_item()) {
+                                if (delta.tool_count == delta.tools.size())
+                                    delta.tools.emplace_back();
+                                read_tool_call(reader, delta.tools[delta.tool_count], delta.tool_count);
+                                ++delta.tool_count;
+                            }
+                        }
+                        else
+                            reader.skip();
+                }
+                else if (key == "text")
+                    reader.read_string(delta.content);
+                else if (key == "finish_reason")
+                    reader.read_string(delta.finish_reason);
+                else
+                    reader.skip();
+        }
+        static void read_tool_call(Json_reader& reader, Tool_fragment& call, size_t position)          // 读取tool_calls中的一项，没有index字段时按位置编号
+        {
+            call.index = position;
+            call.id.clear();
+            call.name.clear();
+            call.arguments.clear();
+            reader.begin_object();
+            for (string_view key; reader.next_key(key); )
+                if (key == "index")
+                    call.index = static_cast<size_t>(reader.read_integer());
+                else if (key == "id")
+                    reader.read_string(call.id);
+                else if (key=="function" and reader.peek()=='{') {
+                    reader.begin_object();
+                    for (string_view field; reader.next_key(field); )
+                        if (field == "name")
+                            reader.read_string(call.name);
+                        else if (field == "arguments")
+                            reader.read_string(call.arguments);
+                        else
+                            reader.skip();
+                }
+                else
+                    reader.skip();
+        }
         
         double temperature;
-        function<size_t(char*, size_t, size_t, Message_func*)> call_back_func;
+        Curl::Retry_policy retry_policy;
+        Curl::Transport::Header_list headers;
+        Deadlines deadlines;
+        Coalescing coalescing;
+        Usage usage;             // 上一次调用的用量
+        string finish_reason;
+        Sample_sink sample_sink;
+        vector<Sample> samples;            // 上一次调用的全部样本
+        vector<Tool> tools;
+        vector<Tool_call> tool_calls;            // 上一次调用中完成的工具调用
+        size_t tool_rounds {8};
+        function<bool()> gate;             // 交给本对象各次调用的首token检查，供Hedge裁决胜负
+        Cancel_token cancel_token;
+        bool stream_upload {};
+        shared_future<void> warming;             // 后台预热的进度
+        bool warm_due {};            // 是否还要自动预热
+        Curl::Transport::Factory transport;            // 为空时使用curl
+        inline static std::atomic<bool> auto_warm {};
     };
     
-    class Reasoner : public LLM {          // Reasoner类是深度思考模型
+    template<typename Model>
+    class Typed_sink {           // Typed_sink类保存回调函数的具体类型，每次调用只经一次虚函数进入按该类型实例化的Model::call，其中每个token直接调用回调函数。复制时复制回调函数
     public:
-        Reasoner(string&& url, string&& model, string&& key, function<void(string&&, bool)> func, int code_encode, int prog_encode) : LLM{std::move(url),std::move(model),std::move(key),code_encode,prog_encode}, func{func} { set_call_back(call_back); }
-        void get(string&& question) override             // 调用大模型
-        {
-            Curl::Curl curl {set_curl(question)};
-            curl.set_write_func(reinterpret_cast<void*>(*(func_call_back().target<size_t(*)(char*, size_t, size_t, Message_func*)>())));
-            Reasonal_message mfunc {prog_enc(),func};
-            curl.set_write_data(&mfunc);
-            curl.perform();
-            add_history(std::move(question), mfunc.get_ans());
-            last_reason = mfunc.remember_reasoning();
+        template<typename F>
+        explicit Typed_sink(F func) : ptr{new Typed<F>{std::move(func)}} { }
+        Typed_sink(const Typed_sink& other) : ptr{(other.ptr) ? other.ptr->clone() : nullptr} { }
+        Typed_sink(Typed_sink&&) =default;
+        Typed_sink& operator=(const Typed_sink& other)
+        {
+            if (this != &other)
+                ptr = (other.ptr) ? other.ptr->clone() : nullptr;
+            return *this;
         }
+        Typed_sink& operator=(Typed_sink&&) =default;
+        void get(Model& model, string&& question) { ptr->get(model, std::move(question)); }
+        void get(Model& model, Curl::Multi& multi, string&& question, Done_func done) { ptr->get(model, multi, std::move(question), std::move(done)); }
+    private:
+        struct Base {
+            virtual unique_ptr<Base> clone() const = 0;
+            virtual void get(Model& model, string&& question) = 0;
+            virtual void get(Model& model, Curl::Multi& multi, string&& question, Done_func done) = 0;
+            virtual ~Base() { }
+        };
+        template<typename F>
+        struct Typed : Base {
+            F func;
+            explicit Typed(F func) : func{std::move(func)} { }
+            unique_ptr<Base> clone() const override { return unique_ptr<Base>{new Typed{func}}; }
+            void get(Model& model, string&& question) override { model.call(func, std::move(question)); }
+            void get(Model& model, Curl::Multi& multi, string&& question, Done_func done) override { model.call(func, multi, std::move(question), std::move(done)); }
+        };
+        unique_ptr<Base> ptr;
+    };
+    
+    class Reasoner : public LLM {          // Reasoner类是深度思考模型
+        friend class Typed_sink<Reasoner>;
+    public:
+        template<typename F, typename =std::enable_if_t<std::is_invocable_v<F&, string&&, bool>>>
+        Reasoner(string&& url, string&& model, string&& key, F func, int code_encode, int prog_encode, string&& unix_socket ={}) : LLM{std::move(url),std::move(model),std::move(key),code_encode,prog_encode,std::move(unix_socket)}, sink{std::move(func)} { }          // func是void或bool(string&& token, bool reasoning)，保留其具体类型，Reason_sink只在需要类型擦除时使用
+        void get(string&& question) override { sink.get(*this, std::move(question)); }             // 调用大模型
+        void get(Curl::Multi& multi, string&& question, Done_func done ={}) override { sink.get(*this, multi, std::move(question), std::move(done)); }         // 异步调用大模型
         using LLM::get;
-        const string& remem_reasoning() const { return last_reason; }
+        void choose_sample(size_t index) override          // 同时换上该样本的深度思考。第0个样本的深度思考写入了文件时，换回它仍从文件读回
+        {
+            LLM::choose_sample(index);
+            last_reason = get_samples()[index].reasoning;
+            spilled = (index == 0) ? first_spilled : Reasoning_handle{};
+            loaded = spilled.file.empty();
+        }
+        void set_reasoning_policy(const Reasoning_policy& policy) { retention = policy; }          // 设置之后各次调用的深度思考保留策略
+        const string& remem_reasoning() const          // 获取上一次深度思考的内容。写入文件的深度思考在首次获取时才读回，文件读取失败时抛出Not_found_error
+        {
+            if (not loaded) {
+                ifstream f_str {spilled.file, std::ios::binary};
+                string text(spilled.length, '\0');
+                if (not f_str.seekg(spilled.offset) or not f_str.read(text.data(), text.length()))
+                    throw Not_found_error{};
+                last_reason = std::move(text);
+                loaded = true;
+            }
+            return last_reason;
+        }
+        const Reasoning_handle& reasoning_handle() const { return spilled; }           // 上一次深度思考在文件中的位置，没有写入文件时file为空
         virtual ~Reasoner() { }
     private:
-        function<void(string&&, bool)> func;
-        string last_reason;
-        static size_t call_back(char* contents, size_t size, size_t nmemb, Message_func* ptr)           // 处理网络请求中每次返回的json
-        {
-            if (not contents)
-                throw LLM_error{"服务器繁忙，请稍后再试。"};
-            string json {encode(CP_UTF8, ptr->prog_enc(), contents)};
-            istringstream json_str {json};
-            for (string line; ; std::getline(json_str, line)) {
-                if (line.empty()) {
-                    if (json_str.eof())
-                        break;
-                    else
-                        continue;
-                }
-                try {
-                    string reasoning_content {read_key(line, "reasoning_content")};
-                    string content {read_key(line, "content")};
-                    bool reasoning = not (reasoning_content=="null");
-                    string& selected {(reasoning) ? reasoning_content : content};
-                    del_quote(selected);
-                    selected = parse(selected);
-                    Reasonal_message& func {dynamic_cast<Reasonal_message&>(*ptr)};
-                    if (reasoning)
-                        func.reason(std::move(selected));
-                    else
-                        func(std::move(selected));
-                }
-                catch (Not_found_error) {
-                    break;
-                }
-            }
-            return size*nmemb;
+        Typed_sink<Reasoner> sink;
+        Reasoning_policy retention;
+        Reasoning_handle spilled;
+        Reasoning_handle first_spilled;          // 上一次调用第0个样本的深度思考在文件中的位置
+        mutable string last_reason;          // 写入文件时为读回的缓存
+        mutable bool loaded {true};
+        template<typename F>
+        void call(F& func, string&& question)            // 按回调函数的类型实例化的调用
+        {
+            Reasonal_message<std::reference_wrapper<F>> mfunc {prog_enc(),std::ref(func)};
+            mfunc.set_retention(retention);
+            auto_warmup();
+            converse(question, mfunc);
+            remember(mfunc);
+            record(std::move(question), mfunc, last_reason);
+        }
+        template<typename F>
+        void call(F& func, Curl::Multi& multi, string&& question, Done_func done)
+        {
+            auto mfunc = make_shared<Reasonal_message<std::reference_wrapper<F>>>(prog_enc(), std::ref(func));
+            mfunc->set_retention(retention);
+            auto ques = make_shared<string>(std::move(question));
+            converse(multi, ques, mfunc, [this, mfunc, ques, done](exception_ptr error) {
+                if (not error)
+                    try {
+                        remember(*mfunc);
+                        record(std::move(*ques), *mfunc, last_reason);
+                    }
+                    catch (...) {
+                        error = std::current_exception();
+                    }
+                if (done)
+                    done(error);
+            });
+        }
+        template<typename Message>
+        void remember(Message& mfunc)            // 按保留策略记下本次调用的深度思考
+        {
+            last_reason = mfunc.remember_reasoning();
+            spilled = first_spilled = mfunc.spilled();
+            loaded = spilled.file.empty();
         }
     };
     
     class Chat : public LLM {          // Chat类是一个通用模型
+        friend class Typed_sink<Chat>;
     public:
-        Chat(string&& url, string&& model, string&& key, function<void(string&&)> func, int code_encode, int prog_encode) : LLM{std::move(url),std::move(model),std::move(key),code_encode,prog_encode}, func{func} { set_call_back(call_back); }
-        void get(string&& question) override             // 调用大模型
-        {
-            Curl::Curl curl {set_curl(question)};
-            curl.set_write_func(reinterpret_cast<void*>(*(func_call_back().target<size_t(*)(char*, size_t, size_t, Message_func*)>())));
-            Chat_message mfunc {prog_enc(),func};
-            curl.set_write_data(&mfunc);
-            curl.perform();
-            add_history(std::move(question), mfunc.get_ans());
-        }
+        template<typename F, typename =std::enable_if_t<std::is_invocable_v<F&, string&&>>>
+        Chat(string&& url, string&& model, string&& key, F func, int code_encode, int prog_encode, string&& unix_socket ={}) : LLM{std::move(url),std::move(model),std::move(key),code_encode,prog_encode,std::move(unix_socket)}, sink{std::move(func)} { }          // func是void或bool(string&& token)，保留其具体类型，Chat_sink只在需要类型擦除时使用
+        void get(string&& question) override { sink.get(*this, std::move(question)); }             // 调用大模型
+        void get(Curl::Multi& multi, string&& question, Done_func done ={}) override { sink.get(*this, multi, std::move(question), std::move(done)); }         // 异步调用大模型
         using LLM::get;
         virtual ~Chat() { }
     private:
-        function<void(string&&)> func;
-        static size_t call_back(char* contents, size_t size, size_t nmemb, Message_func* ptr)          // 处理网络请求中每次返回的json
-        {
-            if (not contents)
-                throw LLM_error{"服务器繁忙，请稍后再试。"};
-            string json {encode(CP_UTF8, ptr->prog_enc(), contents)};
-            istringstream json_str {json};
-            for (string line; ; std::getline(json_str, line)) {
-                if (line.empty()) {
-                    if (json_str.eof())
-                        break;
-                    else
-                        continue;
-                }
-                try {
-                    string content {read_key(line, "content")};
-                    del_quote(content);
-                    content = parse(content);
-                    dynamic_cast<Chat_message&>(*ptr)(std::move(content));
-                }
-                catch (Not_found_error) {
-                    break;
-                }
-            }
-            return size*nmemb;
+        Typed_sink<Chat> sink;
+        template<typename F>
+        void call(F& func, string&& question)            // 按回调函数的类型实例化的调用
+        {
+            Chat_message<std::reference_wrapper<F>> mfunc {prog_enc(),std::ref(func)};
+            auto_warmup();
+            converse(question, mfunc);
+            record(std::move(question), mfunc);
+        }
+        template<typename F>
+        void call(F& func, Curl::Multi& multi, string&& question, Done_func done)
+        {
+            auto mfunc = make_shared<Chat_message<std::reference_wrapper<F>>>(prog_enc(), std::ref(func));
+            auto ques = make_shared<string>(std::move(question));
+            converse(multi, ques, mfunc, [this, mfunc, ques, done](exception_ptr error) {
+                if (not error)
+                    record(std::move(*ques), *mfunc);
+                if (done)
+                    done(error);
+            });
         }
     };
     
     class Fim_base : public Chat {       // Fim_base类是上下文补充模型，deepseek的beta功能，目前尚不稳定
     public:
-        Fim_base(string&& key, function<void(string&&)> func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Chat{"https://api.deepseek.com/beta/completions","deepseek-chat",std::move(key),func,code_encode,prog_encode} { set_call_back(call_back); }
+        template<typename F>
+        Fim_base(string&& key, F func, int code_encode =CP_ACP, int prog_encode =CP_ACP) : Chat{"https://api.deepseek.com/beta/completions","deepseek-chat",std::move(key),std::move(func),code_encode,prog_encode} { }
+    };
+    
+    class Hedge {          // Hedge类对两个持有相同对话的模型发出对冲调用：主模型迟迟没有首个token时，向备用模型发出同样的调用，先出token者胜出，另一个被取消
+    public:
+        Hedge(LLM& primary, LLM& secondary, double percentile =0.95, milliseconds initial_delay =milliseconds{2000}) : primary{primary}, secondary{secondary}, percentile{percentile}, initial_delay{initial_delay} { }
+        void get(string&& question);             // 调用大模型，只有胜者的token会交给它自己的回调函数。结束后两个模型的历史记录都添加胜者的回答
+        void get(const string& question) { get(string{question}); }
+        milliseconds delay() const;          // 当前的对冲延迟：主模型首token耗时的percentile分位数，样本不足时为initial_delay
+        void set_percentile(double p) { percentile = p; }
+        const LLM& winner() const { return *last_winner; }           // 上一次调用的胜者
     private:
-        static size_t call_back(char* contents, size_t size, size_t nmemb, Message_func* ptr)          // 处理网络请求中每次返回的json
-        {
-            if (not contents)
-                throw LLM_error{"服务器繁忙，请稍后再试。"};
-            string json {encode(CP_UTF8, ptr->prog_enc(), contents)};
-            istringstream json_str {json};
-            for (string line; ; std::getline(json_str, line)) {
-                if (line.empty()) {
-                    if (json_str.eof())
-                        break;
-                    else
-                        continue;
-                }
-                try {
-                    string content {read_key(line, "text")};
-                    del_quote(content);
-                    content = parse(content);
-                    dynamic_cast<Chat_message&>(*ptr)(std::move(content));
-                }
-                catch (Not_found_error) {
-                    break;
-                }
-            }
-            return size*nmemb;
-        }
+        LLM& primary;
+        LLM& secondary;
+        double percentile;
+        milliseconds initial_delay;
+        deque<milliseconds> samples;             // 最近若干次主模型的首token耗时
+        LLM* last_winner {&primary};
+        static constexpr size_t max_samples {100};
+        static constexpr size_t min_samples {20};
+        void record(milliseconds latency);
     };
     
 }